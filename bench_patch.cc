@@ -0,0 +1,101 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Microbenchmark: per-send cost of interpreting the packet variables
+// and actions (Packet::apply_variables()) vs. rendering the patch region
+// with the compiled patch program (Packet::render()).
+//
+// Usage: bench_patch [ITERATIONS]
+
+#include "packet.hh"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+
+// cf. flow.toml
+enum { VERSION = 0, SESSION_ID = 8, SESSION_PASSWORD, SEQ_NR };
+
+static void setup(Var_Decls &decls, Vars &globals, std::vector<unsigned char> &locals)
+{
+    decls.offs[VERSION] = 32;           decls.sizes[VERSION] = 30;
+    decls.offs[SESSION_ID] = 28;        decls.sizes[SESSION_ID] = 4;
+    decls.offs[SESSION_PASSWORD] = 62;  decls.sizes[SESSION_PASSWORD] = 32;
+    decls.offs[SEQ_NR] = 16;            decls.sizes[SEQ_NR] = 4;
+    decls.layout();
+
+    memcpy(globals.v[VERSION], "9.0", 3);
+    locals.resize(decls.local_size);
+    locals[decls.local_offs[SESSION_ID]] = 123;
+    memcpy(&locals[decls.local_offs[SESSION_PASSWORD]], "geheim0", 7);
+    locals[decls.local_offs[SEQ_NR]] = 1;
+}
+
+static void setup_main(Packet &p)
+{
+    p.payload.resize(96);
+    p.vars[0] = 1 + SEQ_NR;
+    p.actions[0][0] = 1 + unsigned(Operator::INCREMENT);
+    p.actions[0][1] = 1 + SEQ_NR;
+}
+
+static void setup_login(Packet &p)
+{
+    p.payload.resize(280);
+    p.vars[0] = 1 + SESSION_ID;
+    p.vars[1] = 1 + VERSION;
+    p.vars[2] = 1 + SESSION_PASSWORD;
+    p.vars[3] = 1 + SEQ_NR;
+    p.actions[0][0] = 1 + unsigned(Operator::INCREMENT);
+    p.actions[0][1] = 1 + SEQ_NR;
+}
+
+template <typename F>
+static double bench(size_t n, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned char *b = f();
+        // keeps the compiler from hoisting anything out of the loop
+        asm volatile("" : : "r"(b) : "memory");
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n;
+}
+
+static void run(const char *name, size_t n, void (*setup_packet)(Packet &))
+{
+    Var_Decls decls;
+    Vars globals;
+    std::vector<unsigned char> locals;
+    setup(decls, globals, locals);
+
+    Packet p;
+    setup_packet(p);
+    double before = bench(n, [&]() {
+            p.apply_variables(decls, globals, locals.data());
+            return p.payload.data(); });
+
+    Packet q;
+    setup_packet(q);
+    q.compile(decls, globals);
+    std::vector<unsigned char> buf(q.patch_len);
+    double after = bench(n, [&]() {
+            q.render(locals.data(), buf.data());
+            return buf.data(); });
+
+    std::cout << name << ": apply_variables " << before << " ns, render "
+        << after << " ns (per send)\n";
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? atol(argv[1]) : 100000000;
+
+    run("main packet ", n, setup_main);
+    run("login packet", n, setup_login);
+
+    return 0;
+}
@@ -11,230 +11,814 @@
 #include <ixxx/util.hh>
 #include <ixxx/pthread_util.hh>
 
-#include <unordered_map>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 
-#include <assert.h>
-#include <string.h> // memcpy
-
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/net_tstamp.h> // SOF_TIMESTAMPING_*
+#include <poll.h>
 #include <sys/epoll.h> // epoll_event
+#include <sys/eventfd.h>
 #include <sys/timerfd.h> // TFD_TIMER_ABSTIME
+#include <sys/uio.h> // writev
 
 
-static std::unordered_map<std::string_view, Operator> str2op_map = {
-    { "inc", Operator::INCREMENT }
-};
-Operator str2operator(const std::string_view &s)
+static long next_minute_epoche()
 {
-    return str2op_map[s];
+    struct timespec ts = {0};
+    ixxx::posix::clock_gettime(CLOCK_REALTIME, &ts);
+    long x = ts.tv_sec + 62;
+    x = x / 60 * 60;
+    return x;
+
 }
 
+static void set_timespec_ns(struct timespec &ts, uint64_t ns)
+{
+    uint64_t s = ns / 1000000000ul;
+
+    ts.tv_sec = s;
 
-static void increment_uint(unsigned char *v, unsigned size)
+    ns -= s * 1000000000ul;
+
+    ts.tv_nsec = ns;
+}
+
+
+// reads the correlation key from the rendered patch region,
+// or from the template if it isn't patched
+static uint64_t read_key(const Field &f, const Packet &packet, const unsigned char *patch)
 {
-    switch (size) {
-        case 1:
-            ++*v;
-            break;
-        case 2:
-            {
-                uint16_t i;
-                memcpy(&i, v, size);
-                ++i;
-                memcpy(v, &i, size);
-            }
-            break;
-        case 4:
-            {
-                uint32_t i;
-                memcpy(&i, v, size);
-                ++i;
-                memcpy(v, &i, size);
-            }
-            break;
-        case 8:
-            {
-                uint64_t i;
-                memcpy(&i, v, size);
-                ++i;
-                memcpy(v, &i, size);
-            }
-            break;
+    if (f.off >= packet.patch_off && f.off + f.size <= packet.patch_off + packet.patch_len) {
+        Field g { f.off - packet.patch_off, f.size };
+        return g.read_uint(patch, packet.patch_len);
     }
+    return f.read_uint(packet.payload.data(), packet.payload.size());
 }
 
+unsigned char *Sender::ring_slot(size_t idx, unsigned i)
+{
+    const Session &session = sessions[idx];
+    unsigned k = (session.ring_head + i) % cfg.prerender;
+    return ring.data() + (idx * cfg.prerender + k) * ring_slot_len;
+}
 
-void Packet::apply_variables(const Var_Decls &decls, const Vars &global, Vars &local)
+// renders the next main flow packets of a session, i.e. this advances
+// the session variables ahead of the sends
+void Sender::fill_ring(size_t idx)
 {
-    for (unsigned i = 0; i < sizeof vars / sizeof vars[0]; ++i) {
-        if (!vars[i])
-            break;
+    Session &session = sessions[idx];
+    while (session.ring_count < cfg.prerender) {
+        const Packet &packet = cfg.main_flow[(session.flow_pos + session.ring_count)
+            % cfg.main_flow.size()];
+        packet.render(vars(idx), ring_slot(idx, session.ring_count));
+        ++session.ring_count;
+    }
+}
 
-        unsigned k = vars[i] - 1;
-        unsigned n = sizeof global.v / sizeof global.v[0];
-        assert(k < 2*n);
-
-        const Vars *t;
-        unsigned j;
-        if (k < n) {
-            t = &global;
-            j = k;
-        } else {
-            t = &local;
-            j = k - n;
-        }
-        memcpy(payload + decls.offs[k], t->v[j], decls.sizes[k]);
+// called when there is nothing due
+void Sender::refill_rings()
+{
+    for (size_t idx : refill)
+        fill_ring(idx);
+    refill.clear();
+}
 
+void Sender::update_tai_off(uint64_t now)
+{
+    if (!cfg.tai_stamps)
+        return;
+    struct timespec ts;
+    ixxx::posix::clock_gettime(CLOCK_TAI, &ts);
+    tai_off_ns = uint64_t(ts.tv_sec) * 1000000000ul + ts.tv_nsec - now;
+}
 
+// stamps the send timestamp variables of the packet
+void Sender::stamp_packet(const Packet &packet, unsigned char *patch,
+        uint64_t now, uint64_t sched_ns)
+{
+    if (!packet.no_stamps)
+        return;
+    uint64_t ns[4] = { 0, now, now + tai_off_ns, sched_ns };
+    packet.stamp(patch, ns);
+}
+
+// logs the write for matching the kernel TX timestamps (SOF_TIMESTAMPING_OPT_ID),
+// before the write such that the receiver can't see a stamp first
+void Sender::log_write(Session &session, size_t n, uint64_t t0)
+{
+    session.tx_bytes += n;
+    uint64_t key = session.tx_writes << 32 | uint32_t(session.tx_bytes - 1);
+    session.writes->put_at(session.tx_writes % Stamp_Table::SLOTS, key, t0);
+    ++session.tx_writes;
+}
+
+// sched_ns: the intended send time, i.e. latencies are measured relative
+// to it such that a late sender doesn't hide them (coordinated omission),
+// returns the completion time of the write, or 0 if the message was
+// dropped because of backpressure or is completed asynchronously (io_uring)
+uint64_t Sender::send(Session &session, uint64_t sched_ns)
+{
+    if (session.outq && session.outq->size() >= cfg.max_queued_bytes) {
+        // the server doesn't keep up with this session, skipped
+        // before rendering, thus without a gap in the session's sequence
+        ++session.metrics->backpressure_drops;
+        return 0;
     }
-    for (unsigned i = 0; i < sizeof actions / sizeof actions[0]; ++i) {
-        if (!actions[i][0])
-            break;
+#ifdef TCPLOADGEN_URING
+    if (uring && !uring_ready(session)) {
+        ++session.metrics->backpressure_drops;
+        return 0;
+    }
+#endif
+    const Packet &packet = cfg.main_flow[session.flow_pos++ % cfg.main_flow.size()];
+    unsigned char *patch = patch_buf.data();
+    size_t idx = &session - sessions.data();
+    if (session.ring_count) {
+        patch = ring_slot(idx, 0);
+        if (session.ring_count-- == cfg.prerender)
+            refill.push_back(idx);
+        session.ring_head = (session.ring_head + 1) % cfg.prerender;
+    } else {
+        // prerendering is disabled or the ring ran empty
+        // while catching up
+        packet.render(vars(idx), patch_buf.data());
+    }
+    uint64_t t0 = stamp_now_ns();
+    stamp_packet(packet, patch, t0, sched_ns);
+    if (session.stamps)
+        session.stamps->put(read_key(cfg.correlation, packet, patch), sched_ns);
+    metrics->send_error_hist.record(t0 > sched_ns ? t0 - sched_ns : 0);
+    if (session.writes)
+        log_write(session, packet.payload.size(), t0);
+#ifdef TCPLOADGEN_URING
+    if (uring) {
+        // the write and completion times are recorded when
+        // the completion is reaped, cf. uring_reap()
+        uring_send(session, packet, patch, t0, sched_ns);
+        achieved.record(t0);
+        ++metrics->send_count;
+        ++session.metrics->send_count;
+        return 0;
+    }
+#endif
+    if (cfg.blocking_writes)
+        write_packet(session.fd, packet, patch);
+    else
+        write_or_queue(session, packet, patch, t0);
+    uint64_t t1 = stamp_now_ns();
+    metrics->write_hist.record(t1 - t0);
+    achieved.record(t1);
+
+    ++metrics->send_count;
+    ++session.metrics->send_count;
+    return t1;
+}
 
-        Operator a = Operator(actions[i][0] - 1);
-        unsigned k = actions[i][1] - 1;
-        unsigned n = sizeof global.v / sizeof global.v[0];
-        assert(k < 2*n);
-
-        Vars *t;
-        unsigned j;
-        if (k < n) {
-            throw std::runtime_error("cannot modify globals");
-        } else {
-            t = &local;
-            j = k - n;
+void writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n) {
+        ssize_t l = writev(fd, iov, n);
+        if (l == -1) {
+            if (errno == EINTR)
+                continue;
+            std::ostringstream o;
+            o << "writev failed on fd " << fd << " (" << errno << ')';
+            throw std::runtime_error(o.str());
         }
-
-        switch (a) {
-            case Operator::INCREMENT:
-                increment_uint(t->v[j], decls.sizes[k]);
-                break;
-            default:
-                throw std::runtime_error("unknown operator");
+        for (; n && size_t(l) >= iov->iov_len; ++iov, --n)
+            l -= iov->iov_len;
+        if (n) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + l;
+            iov->iov_len -= l;
         }
     }
 }
 
+// collects the template parts of the payload and the rendered patch region,
+// returns the number of used iov elements (at most 3)
+int packet_iov(const Packet &packet, const unsigned char *patch, struct iovec *iov)
+{
+    unsigned char *p = const_cast<unsigned char*>(packet.payload.data());
+    size_t tail = packet.patch_off + packet.patch_len;
+    int n = 0;
+    if (packet.patch_off)
+        iov[n++] = { p, packet.patch_off };
+    if (packet.patch_len)
+        iov[n++] = { const_cast<unsigned char*>(patch), packet.patch_len };
+    if (tail < packet.payload.size())
+        iov[n++] = { p + tail, packet.payload.size() - tail };
+    return n;
+}
 
+void Sender::write_packet(int fd, const Packet &packet, const unsigned char *patch)
+{
+    struct iovec iov[3];
+    int n = packet_iov(packet, patch, iov);
+    ++syscalls;
+    writev_all(fd, iov, n);
+}
 
+// writes what fits into the socket buffer and queues the rest,
+// packets are appended to a non-empty queue to keep their order
+void Sender::write_or_queue(Session &session, const Packet &packet,
+        const unsigned char *patch, uint64_t t0)
+{
+    struct iovec iov[3];
+    int n = packet_iov(packet, patch, iov);
+    size_t l = 0;
+    if (!session.outq || session.outq->empty()) {
+        ++syscalls;
+        ssize_t r = writev(session.fd, iov, n);
+        if (r == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::ostringstream o;
+                o << "writev failed on fd " << session.fd << " (" << errno << ')';
+                throw std::runtime_error(o.str());
+            }
+            r = 0;
+        }
+        if (size_t(r) == packet.payload.size())
+            return;
+        l = r;
+        ++session.metrics->eagain_count;
+    }
+    if (!session.outq)
+        session.outq = std::make_unique<Outbound>();
+    Outbound &q = *session.outq;
+    bool was_empty = q.empty();
+    for (int i = 0; i < n; ++i) {
+        const unsigned char *p = static_cast<const unsigned char*>(iov[i].iov_base);
+        size_t k = std::min(l, iov[i].iov_len);
+        q.buf.insert(q.buf.end(), p + k, p + iov[i].iov_len);
+        l -= k;
+    }
+    q.pending.emplace_back(q.buf.size(), t0);
+    q.max_size = std::max(q.max_size, q.size());
+    session.metrics->queued_bytes.store(q.size());
+    if (was_empty)
+        watch_out(session, true);
+}
 
-static long next_minute_epoche()
+// called on EPOLLOUT
+void Sender::drain(Session &session)
 {
-    struct timespec ts = {0};
-    ixxx::posix::clock_gettime(CLOCK_REALTIME, &ts);
-    long x = ts.tv_sec + 62;
-    x = x / 60 * 60;
-    return x;
+    Outbound &q = *session.outq;
+    ++syscalls;
+    ssize_t l = write(session.fd, q.buf.data() + q.head, q.size());
+    if (l == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            ++session.metrics->eagain_count;
+            return;
+        }
+        std::ostringstream o;
+        o << "write failed on fd " << session.fd << " (" << errno << ')';
+        throw std::runtime_error(o.str());
+    }
+    q.head += l;
+    uint64_t now = stamp_now_ns();
+    for (; q.pending_head < q.pending.size()
+            && q.pending[q.pending_head].first <= q.head; ++q.pending_head) {
+        uint64_t d = now - q.pending[q.pending_head].second;
+        q.delays.record(d);
+        queue_delay_hist.record(d);
+    }
+    if (q.empty()) {
+        q.buf.clear();
+        q.pending.clear();
+        q.head = 0;
+        q.pending_head = 0;
+        watch_out(session, false);
+    } else if (q.head >= 64 * 1024 && 2 * q.head >= q.buf.size()) {
+        // compacts the queue of a session that never fully drains
+        q.buf.erase(q.buf.begin(), q.buf.begin() + q.head);
+        q.pending.erase(q.pending.begin(), q.pending.begin() + q.pending_head);
+        for (auto &p : q.pending)
+            p.first -= q.head;
+        q.head = 0;
+        q.pending_head = 0;
+    }
+    session.metrics->queued_bytes.store(q.size());
+}
 
+// toggles the EPOLLOUT interest while a session has queued bytes; in inline
+// receive mode the socket is already registered for its responses
+void Sender::watch_out(Session &session, bool on)
+{
+    ++syscalls;
+    if (on)
+        ++backlogged;
+    else
+        --backlogged;
+    struct epoll_event ev = { .events = EPOLLOUT,
+        .data = { .ptr = static_cast<Session*>(&session) } };
+    if (rx) {
+        ev.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0u);
+        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_MOD, session.fd, &ev);
+    } else {
+        ixxx::linux::epoll_ctl(efd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, session.fd, &ev);
+    }
 }
 
-static void login(int fd, std::vector<Packet> &flow, const Var_Decls &var_decls,
-        const Vars &globals, Vars &locals, const Receiver_Config &cfg)
+void Sender::arm_timer(int tfd)
 {
-    unsigned char buf[64*1024];
-    for (auto &packet : flow) {
-        packet.apply_variables(var_decls, globals, locals);
-        ixxx::util::write_all(fd, packet.payload, packet.payload_size);
+    struct itimerspec spec = { 0 };
+    set_timespec_ns(spec.it_value, timers.top().deadline);
+    // NB: re-arming also resets the expiration count, thus, we don't
+    // need to read the timerfd after a wake-up
+    ++syscalls;
+    ixxx::linux::timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec,  0);
+}
 
-        cfg.receive_next(fd, buf, sizeof buf);
-        unsigned t = cfg.tag.read_uint(buf, sizeof buf);
-        if (t != packet.answer_tag) {
+// Writes the queued bytes of the backlogged sessions until they are
+// empty or the timeout expires. They were already counted as sent, thus
+// the remaining ones are reported as discarded.
+void Sender::drain_backlog(uint64_t timeout_ns)
+{
+    uint64_t deadline = stamp_now_ns() + timeout_ns;
+    std::vector<struct pollfd> fds;
+    std::vector<Session*> backlog;
+    for (;;) {
+        fds.clear();
+        backlog.clear();
+        for (auto &session : sessions)
+            if (session.outq && !session.outq->empty()) {
+                fds.push_back({ session.fd, POLLOUT, 0 });
+                backlog.push_back(&session);
+            }
+        uint64_t now = stamp_now_ns();
+        if (fds.empty() || now >= deadline)
+            break;
+        ++syscalls;
+        int r = poll(fds.data(), fds.size(), int((deadline - now + 999999) / 1000000));
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
             std::ostringstream o;
-            o << "Unexpected answer tag: " << t << " (expected: " << packet.answer_tag << ')';
+            o << "poll failed while draining (" << errno << ')';
             throw std::runtime_error(o.str());
         }
+        for (size_t i = 0; i < fds.size(); ++i)
+            if (fds[i].revents)
+                drain(*backlog[i]);
+    }
+    for (Session *session : backlog) {
+        Outbound &q = *session->outq;
+        q.discarded_msgs = q.pending.size() - q.pending_head;
+        q.discarded_bytes = q.size();
     }
 }
 
-static void set_timespec_ns(struct timespec &ts, uint64_t ns)
+void Sender::shutdown_sessions()
 {
-    uint64_t s = ns / 1000000000ul;
+#ifdef TCPLOADGEN_URING
+    // the in-flight sends still reference the connections
+    if (uring)
+        uring_flush();
+#endif
+    if (backlogged)
+        drain_backlog(1000000000ul);
+    for (auto &session : sessions) {
+        auto c = session.fd;
+        std::cout << "Shutting down fd: " << c << '\n';
+        ixxx::posix::shutdown(c, SHUT_RDWR);
+        // we are closing it in the receiver!
+        // (closing it here would remove it from the receiver's epoll set
+        //  without a wake-up ...)
+        if (rx)
+            rx->close_conn(c);
+    }
+}
 
-    ts.tv_sec = s;
+// returns false when done
+bool Sender::fire_due(uint64_t now)
+{
+    update_tai_off(now);
+    if (!timers.empty()) {
+        uint64_t deadline = timers.top().deadline;
+        wakeup_hist.record(now > deadline ? now - deadline : 0);
+    }
+    while (!timers.empty() && timers.top().deadline <= now) {
+        Session &session = sessions[timers.top().idx];
+
+        // all messages with an intended time <= now are due
+        unsigned n = 0;
+        while (session.next_ns <= now) {
+            uint64_t sched_ns = session.next_ns;
+            session.next_ns += cfg.profile.next_interval(session.interval_ns,
+                    sched_ns - epoch_ns, session.rng);
+            offered.record(sched_ns);
+            ++n;
+
+            // only send the latest one unless catching up
+            if (!cfg.catch_up && session.next_ns <= now) {
+                ++metrics->dropped_count;
+                continue;
+            }
+            if (metrics->send_count >= no_of_sends) {
+                shutdown_sessions();
+                return false;
+            }
+            uint64_t t1 = send(session, sched_ns);
+            if (t1)
+                completion_hist.record(t1 > sched_ns ? t1 - sched_ns : 0);
+        }
+        if (n != 1) {
+            std::cerr << "Timer expired more than once on core " << core << ": " << n << '\n';
+            ++metrics->timer_was_late;
+        }
 
-    ns -= s * 1000000000ul;
+        timers.replace_top(session.next_ns);
+    }
+    return true;
+}
 
-    ts.tv_nsec = ns;
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
 }
 
+// busy-polls the clock instead of sleeping on the timer,
+// i.e. meant for isolated cores
+void *Sender::spin_loop(int efd, int tfd)
+{
+    // how often to check for an early receiver termination,
+    // in inline receive mode we have to poll the sockets each time
+    const uint64_t check_interval_ns = rx ? 0 : 1000000;
+    uint64_t next_check = 0;
+    struct epoll_event evs[16];
+    for (;;) {
+        uint64_t now = stamp_now_ns();
+        if (timers.top().deadline <= now) {
+            if (!fire_due(now))
+                return 0;
+            continue;
+        }
+        if (!refill.empty()) {
+            fill_ring(refill.back());
+            refill.pop_back();
+            continue;
+        }
+        if (now >= next_check || backlogged) {
+            ++syscalls;
+            int k = epoll_wait(efd, evs, sizeof evs / sizeof evs[0], 0);
+            for (int i = 0; i < k; ++i)
+                if (!dispatch(evs[i], tfd))
+                    return 0;
+            next_check = now + check_interval_ns;
+        }
+        cpu_relax();
+    }
+    return 0;
+}
 
-void *Sender::main()
+// returns false when done
+bool Sender::dispatch(const struct epoll_event &ev, int tfd)
 {
-    ixxx::util::FD efd ( ixxx::linux::epoll_create1(0) );
-    {
-        struct epoll_event ev = { .events = EPOLLERR,
-            .data = { .ptr = 0 } };
-        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, cfg.receiver_pipe_in_fd, &ev);
+    if (!ev.data.ptr) {
+        // this will also close the write-side of the pipe
+        // which is detected by the receiver-thread which then terminates, as well
+        throw std::runtime_error("receiver terminated early");
     }
-    std::vector<ixxx::util::FD> tfds; // i.e. for auto-closing
-    tfds.reserve(sessions.size());
-    for (auto &session : sessions) {
-        session.fd = ixxx::util::connect(host, port);
-        if (session.fd == -1) {
-            std::ostringstream o;
-            o << "Couldn't connect to " << host << ':' << port << " (" << errno << ')';
-            throw std::runtime_error(o.str());
+    if (ev.data.ptr == static_cast<void*>(this)) {
+        if (!cfg.windows.empty()) {
+            // without window_phase_ns the timer isn't re-armed (which
+            // resets it), thus, the expiration has to be consumed, otherwise
+            // the level-triggered epoll reports it again and again
+            uint64_t x;
+            ++syscalls;
+            if (read(tfd, &x, sizeof x) == -1 && errno != EAGAIN)
+                throw std::runtime_error("couldn't read phase timerfd");
+            return next_phase(tfd);
         }
+        if (!fire_due(stamp_now_ns()))
+            return false;
+        arm_timer(tfd);
+        return true;
+    }
+    if (ev.data.ptr == static_cast<void*>(&wake_fd)) {
+        // a receiver thread released some credits
+        uint64_t x;
+        ++syscalls;
+        if (read(wake_fd, &x, sizeof x) == -1 && errno != EAGAIN)
+            throw std::runtime_error("couldn't read wake-up eventfd");
+        return !phase_start_ns || pump_all();
+    }
+    // a backlogged session or inline receive mode
+    Session &session = *static_cast<Session*>(ev.data.ptr);
+    if ((ev.events & EPOLLOUT) && session.outq && !session.outq->empty())
+        drain(session);
+    if (rx && rx->handle_conn_event(session.fd, ev.events))
+        throw std::runtime_error("all connections closed early");
+    if (session.window && phase_start_ns)
+        return pump(session);
+    return true;
+}
 
-        login(session.fd, prelude_flow, cfg.var_decls, cfg.vars, session.vars, receiver_cfg);
+void Sender::finish_phases()
+{
+    phase_durations.push_back(stamp_now_ns() - phase_start_ns);
+    shutdown_sessions();
+}
 
-        ixxx::posix::write(cfg.receiver_pipe_in_fd, &session.fd, sizeof session.fd);
+// sends requests until the session's window is full,
+// returns false when done
+bool Sender::pump(Session &session)
+{
+    Credit_Window &w = *session.window;
+    unsigned n = cfg.windows[window_phase];
+    uint64_t sent = w.sent.load(std::memory_order_relaxed);
+    while (sent - w.completed.load(std::memory_order_acquire) < n) {
+        // resumed after draining, cf. dispatch()
+        if (session.outq && session.outq->size() >= cfg.max_queued_bytes)
+            break;
+        if (metrics->send_count >= no_of_sends) {
+            finish_phases();
+            return false;
+        }
+        uint64_t now = stamp_now_ns();
+        w.ts[sent % Credit_Window::MAX] = now;
+        w.phase[sent % Credit_Window::MAX] = window_phase;
+        // published before the write, thus the receiver can't see the response first
+        w.sent.store(++sent, std::memory_order_release);
+        send(session, now);
+    }
+    return true;
+}
 
-        session.tfd = ixxx::linux::timerfd_create(CLOCK_REALTIME, 0);
-        tfds.emplace_back(session.tfd);
+bool Sender::pump_all()
+{
+    for (auto &session : sessions)
+        if (!pump(session))
+            return false;
+    return true;
+}
 
+// starts the first or switches to the next window size,
+// returns false when done
+bool Sender::next_phase(int tfd)
+{
+    uint64_t now = stamp_now_ns();
+    if (phase_start_ns) {
+        if (window_phase + 1 == cfg.windows.size()) {
+            finish_phases();
+            return false;
+        }
+        phase_durations.push_back(now - phase_start_ns);
+        ++window_phase;
+    }
+    phase_start_ns = now;
+    if (cfg.window_phase_ns) {
+        ++syscalls;
         struct itimerspec spec = { 0 };
-        set_timespec_ns(spec.it_interval, session.interval_ns);
-        set_timespec_ns(spec.it_value, session.start_off_ns);
-        spec.it_value.tv_sec += next_minute_epoche();
-        ixxx::linux::timerfd_settime(session.tfd, TFD_TIMER_ABSTIME, &spec,  0);
-
-        struct epoll_event ev = { .events = EPOLLIN,
-            .data = { .ptr = static_cast<Session*>(&session) } };
-        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, session.tfd, &ev);
+        set_timespec_ns(spec.it_value, epoch_ns + (window_phase + 1) * cfg.window_phase_ns);
+        ixxx::linux::timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec,  0);
     }
+    return pump_all();
+}
+
+// writes main flow packets back-to-back, as fast as possible,
+// starting at the epoch
+void *Sender::flood_loop(int efd, int tfd)
+{
     struct epoll_event evs[16];
-    bool loop_on = true;
-    while (loop_on) {
+    struct itimerspec spec = { 0 };
+    set_timespec_ns(spec.it_value, epoch_ns);
+    ixxx::linux::timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec,  0);
+    for (bool started = false; !started; ) {
         int k = epoll_wait(efd, evs, sizeof evs / sizeof evs[0], -1);
         for (int i = 0; i < k; ++i) {
+            if (evs[i].data.ptr == static_cast<void*>(this))
+                started = true;
+            else if (!dispatch(evs[i], tfd))
+                return 0;
+        }
+    }
 
-            if (!evs[i].data.ptr) {
-                // this will also close the write-side of the pipe
-                // which is detected by the receiver-thread which then terminates, as well
-                throw std::runtime_error("receiver terminated early");
+    unsigned batch = cfg.flood_batch;
+    std::vector<unsigned char> buf(batch * patch_buf.size());
+    std::vector<struct iovec> iov(3 * batch);
+
+    uint64_t wall0 = stamp_now_ns();
+    uint64_t cpu0 = thread_cpu_ns();
+    for (;;) {
+        if (cfg.tai_stamps)
+            update_tai_off(stamp_now_ns());
+        for (auto &session : sessions) {
+            size_t m = std::min<size_t>(batch, no_of_sends - metrics->send_count);
+            if (!m) {
+                flood_wall_ns = stamp_now_ns() - wall0;
+                flood_cpu_ns = thread_cpu_ns() - cpu0;
+                shutdown_sessions();
+                return 0;
+            }
+            uint64_t t0 = stamp_now_ns();
+            int n = 0;
+            size_t bytes = 0;
+            for (size_t j = 0; j < m; ++j) {
+                const Packet &packet = cfg.main_flow[session.flow_pos++ % cfg.main_flow.size()];
+                unsigned char *patch = buf.data() + j * patch_buf.size();
+                packet.render(vars(&session - sessions.data()), patch);
+                stamp_packet(packet, patch, t0, t0);
+                if (session.stamps)
+                    session.stamps->put(read_key(cfg.correlation, packet, patch), t0);
+                n += packet_iov(packet, patch, iov.data() + n);
+                bytes += packet.payload.size();
             }
+            flood_bytes += bytes;
+            if (session.writes)
+                log_write(session, bytes, t0);
+            ++syscalls;
+            writev_all(session.fd, iov.data(), n);
+            metrics->write_hist.record(stamp_now_ns() - t0);
+            metrics->send_count += m;
+            session.metrics->send_count += m;
+        }
+        // checks for an early receiver termination and,
+        // in inline receive mode, process the responses
+        ++syscalls;
+        int k = epoll_wait(efd, evs, sizeof evs / sizeof evs[0], 0);
+        for (int i = 0; i < k; ++i)
+            if (evs[i].data.ptr != static_cast<void*>(this) && !dispatch(evs[i], tfd))
+                return 0;
+    }
+    return 0;
+}
 
-            Session &session = *static_cast<Session*>(evs[i].data.ptr);
+// the sessions aren't driven by timers, the timer just switches
+// the window phases, starting at the epoch
+void *Sender::closed_loop(int efd, int tfd)
+{
+    struct itimerspec spec = { 0 };
+    set_timespec_ns(spec.it_value, epoch_ns);
+    ixxx::linux::timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec,  0);
 
-            uint64_t n = 0;
-            auto l = ixxx::posix::read(session.tfd, &n, sizeof n);
-            assert(l == sizeof n);
-            if (n != 1) {
-                std::cerr << "Timer expired more than once on core " << core << ": " << l << '\n';
-                ++timer_was_late;
-            }
+    struct epoll_event evs[16];
+    for (;;) {
+        refill_rings();
+        // in spin mode, the credits are polled instead of waiting for wake-ups
+        ++syscalls;
+        int k = epoll_wait(efd, evs, sizeof evs / sizeof evs[0], spin ? 0 : -1);
+        // once per wake-up, like fire_due()
+        if (cfg.tai_stamps)
+            update_tai_off(stamp_now_ns());
+        for (int i = 0; i < k; ++i) {
+            if (!dispatch(evs[i], tfd))
+                return 0;
+        }
+        if (spin && phase_start_ns && !pump_all())
+            return 0;
+    }
+    return 0;
+}
 
-            if (send_count >= no_of_sends) {
-                for (auto &session : sessions) {
-                    auto c = session.fd;
-                    std::cout << "Shutting down fd: " << c << '\n';
-                    ixxx::posix::shutdown(c, SHUT_RDWR);
-                    // we are closing it in the receiver!
-                    // (closing it here would remove it from the receiver's epoll set
-                    //  without a wake-up ...)
-                }
-                loop_on = false;
-                break;
-            }
+// hands an established session over to the receiver and schedules it
+void Sender::activate(Session &session, int efd)
+{
+    if (cfg.correlation.size)
+        session.stamps = std::make_unique<Stamp_Table>();
+    if (receiver_cfg.timestamping) {
+        // OPT_ID counts the bytes written from now on
+        int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+            | SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_RX_SOFTWARE
+            | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        ixxx::posix::setsockopt(session.fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags);
+        session.writes = std::make_unique<Stamp_Table>();
+    }
+    if (!cfg.blocking_writes && !cfg.flood && !cfg.io_uring) {
+        int flags = ixxx::posix::fcntl(session.fd, F_GETFL);
+        ixxx::posix::fcntl(session.fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    if (!cfg.windows.empty()) {
+        session.window = std::make_unique<Credit_Window>();
+        session.window->wake_fd = wake_fd;
+    }
+
+    Conn_Announcement a;
+    a.fd = session.fd;
+    a.session_id = session.id;
+    a.stamps = session.stamps.get();
+    a.window = session.window.get();
+    a.received = session.received;
+    a.writes = session.writes.get();
+    a.leftover = session.leftover.get();
+    if (rx) {
+        rx->add_conn(a);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP,
+            .data = { .ptr = static_cast<Session*>(&session) } };
+        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, session.fd, &ev);
+    } else {
+        ixxx::posix::write(cfg.receiver_pipe_in_fds[session.receiver], &a, sizeof a);
+    }
 
-            Packet &packet = main_flow[session.flow_pos++ % main_flow.size()];
-            packet.apply_variables(cfg.var_decls, cfg.vars, session.vars);
-            ixxx::util::write_all(session.fd, packet.payload, packet.payload_size);
+    session.next_ns = epoch_ns + session.start_off_ns;
+    session.rng = cfg.profile.seed + session.id;
+
+    timers.push(session.next_ns, &session - sessions.data());
+}
+
+void Sender::generate_vars()
+{
+    const std::vector<Session_Generator> &gens = cfg.generators;
+    var_bytes.resize(sessions.size() * cfg.var_decls.local_size);
+    std::string tmp;
+    for (size_t idx = 0; idx < sessions.size(); ++idx) {
+        uint64_t k = sessions[idx].id;
+        auto g = std::upper_bound(gens.begin(), gens.end(), k,
+                [](uint64_t k, const Session_Generator &g) { return k < g.first; }) - 1;
+        g->expand(k - g->first, vars(idx), tmp);
+    }
+}
 
-            ++send_count;
+void *Sender::main()
+{
+    ixxx::util::FD efd ( ixxx::linux::epoll_create1(0) );
+    this->efd = efd;
+    for (int fd : cfg.receiver_pipe_in_fds) {
+        struct epoll_event ev = { .events = EPOLLERR,
+            .data = { .ptr = 0 } };
+        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    // one timer for all sessions of this sender
+    ixxx::util::FD tfd ( ixxx::linux::timerfd_create(CLOCK_REALTIME, 0) );
+    {
+        struct epoll_event ev = { .events = EPOLLIN,
+            .data = { .ptr = static_cast<void*>(this) } };
+        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+    }
+    // receiver threads wake up this sender when they release credits
+    ixxx::util::FD wfd;
+    if (!cfg.windows.empty() && !rx && !spin) {
+        wfd = ixxx::util::FD(ixxx::linux::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        wake_fd = wfd;
+        struct epoll_event ev = { .events = EPOLLIN,
+            .data = { .ptr = static_cast<void*>(&wake_fd) } };
+        ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+    size_t patch_len = 0;
+    for (auto *flow : { &cfg.prelude_flow, &cfg.main_flow })
+        for (auto &packet : *flow)
+            patch_len = std::max<size_t>(patch_len, packet.patch_len);
+    patch_buf.resize(patch_len);
+    if (cfg.prerender) {
+        for (auto &packet : cfg.main_flow)
+            ring_slot_len = std::max<size_t>(ring_slot_len, packet.patch_len);
+        ring.resize(sessions.size() * cfg.prerender * ring_slot_len);
+        refill.reserve(sessions.size());
+    }
 
+    generate_vars();
+    establish();
+
+    epoch_ns = next_minute_epoche() * 1000000000ul;
+    for (Rate_Log *log : { &offered, &achieved }) {
+        log->start_ns = epoch_ns;
+        log->interval_ns = cfg.profile.report_interval_ns;
+        if (log->interval_ns)
+            log->counts.reserve(1024);
+    }
+    timers.reserve(sessions.size());
+    for (auto &session : sessions)
+        activate(session, efd);
+    if (cfg.prerender)
+        for (size_t i = 0; i < sessions.size(); ++i)
+            fill_ring(i);
+
+    if (timers.empty())
+        return 0;
+    syscalls = 0;
+    uint64_t cpu0 = thread_cpu_ns();
+    void *r = run(efd, tfd);
+    cpu_ns = thread_cpu_ns() - cpu0;
+    return r;
+}
+
+void *Sender::run(int efd, int tfd)
+{
+    if (!cfg.windows.empty())
+        return closed_loop(efd, tfd);
+    if (cfg.flood)
+        return flood_loop(efd, tfd);
+    if (spin)
+        return spin_loop(efd, tfd);
+#ifdef TCPLOADGEN_URING
+    if (cfg.io_uring)
+        return uring_loop(efd);
+#endif
+    arm_timer(tfd);
+
+    struct epoll_event evs[16];
+    for (;;) {
+        refill_rings();
+        ++syscalls;
+        int k = epoll_wait(efd, evs, sizeof evs / sizeof evs[0], -1);
+        for (int i = 0; i < k; ++i) {
+            if (!dispatch(evs[i], tfd))
+                return 0;
         }
     }
     return 0;
@@ -247,7 +831,8 @@ static void *sender_main(void *x)
         void *v = s->main();
         return v;
     } catch (std::exception &e) {
-        close(s->cfg.receiver_pipe_in_fd);
+        for (int fd : s->cfg.receiver_pipe_in_fds)
+            close(fd);
         std::cerr << "Sender failed: " << e.what() << '\n';
         return (void*)-1;
     }
@@ -276,3 +861,82 @@ void Sender::spawn(bool realtime, bool affinity)
 }
 
 
+void Client::setup_metrics()
+{
+    size_t no_sessions = 0;
+    for (auto &sender : senders)
+        no_sessions += sender.sessions.size();
+    std::vector<Receiver*> rxs;
+    for (auto &receiver : receivers)
+        rxs.push_back(&receiver);
+    for (auto &sender : senders)
+        if (sender.rx)
+            rxs.push_back(sender.rx.get());
+
+    metrics.create(metrics_file, senders.size(), rxs.size(), no_sessions);
+
+    const Metrics_Header &h = *metrics.header;
+    size_t k = 0;
+    for (size_t i = 0; i < senders.size(); ++i) {
+        Sender &sender = senders[i];
+        sender.metrics = h.senders() + i;
+        sender.metrics->core = sender.core;
+        for (auto &session : sender.sessions) {
+            session.metrics = h.sessions() + k;
+            session.metrics->session_id = session.id;
+            session.metrics->core = sender.core;
+            session.received = h.session_received() + k;
+            ++k;
+        }
+    }
+    for (size_t i = 0; i < rxs.size(); ++i) {
+        rxs[i]->metrics = h.receivers() + i;
+        rxs[i]->metrics->core = rxs[i]->core;
+        if (!record_file.empty()) {
+            rxs[i]->recorder = std::make_unique<Recorder>();
+            rxs[i]->recorder->create(record_file + '.' + std::to_string(i),
+                    record_size, rxs[i]->core);
+        }
+    }
+}
+
+void Client::setup_receivers()
+{
+    if (receiver_cfg.inline_receive) {
+        // the senders process their responses themselves
+        receivers.clear();
+        for (auto &sender : senders) {
+            sender.rx = std::make_unique<Receiver>(receiver_cfg);
+            sender.rx->core = sender.core;
+        }
+        return;
+    }
+    size_t n = 0;
+    for (auto &sender : senders)
+        n += shard_by_session ? sender.sessions.size() : !sender.sessions.empty();
+    // such that each receiver gets at least one connection
+    // and thus terminates when all of them are closed
+    while (receivers.size() > 1 && receivers.size() > n)
+        receivers.pop_back();
+
+    for (auto &receiver : receivers) {
+        int rw_pipe[2] = {0};
+        ixxx::posix::pipe(rw_pipe);
+        sender_cfg.receiver_pipe_in_fds.push_back(rw_pipe[1]);
+        receiver.pipe_out_fd = rw_pipe[0];
+    }
+
+    unsigned k = 0;
+    for (auto &sender : senders) {
+        if (sender.sessions.empty())
+            continue;
+        for (auto &session : sender.sessions) {
+            if (shard_by_session)
+                session.receiver = k++ % receivers.size();
+            else
+                session.receiver = k % receivers.size();
+        }
+        if (!shard_by_session)
+            ++k;
+    }
+}
@@ -5,61 +5,190 @@
 #ifndef CLIENT_HH
 #define CLIENT_HH
 
+#include "packet.hh"
 #include "receiver.hh"
-
+#include "histogram.hh"
+#include "timer_heap.hh"
+#include "profile.hh"
+#include "counter.hh"
+#include "stats.hh"
+#include "metrics.hh"
+
+#include <string>
 #include <vector>
-#include <string_view>
+#include <memory>
+#include <utility>
 #include <stdint.h>
 
-struct Var_Decls {
-    unsigned char sizes[16] {0};
-    unsigned offs[16] {0};
-};
-
-struct Vars {
-    unsigned char v[8][32] {0};
-
-};
+#include <sys/epoll.h> // epoll_event
+#include <sys/uio.h> // iovec
 
+// shared with the io_uring backend (uring.cc)
+int packet_iov(const Packet &packet, const unsigned char *patch, struct iovec *iov);
+void writev_all(int fd, struct iovec *iov, int n);
 
-enum class Operator {
-    INCREMENT
-};
+// io_uring backend state of a sender, only defined in uring.cc
+struct Uring_Sender;
 
-Operator str2operator(const std::string_view &s);
+// bytes of a session that didn't fit into its socket buffer,
+// drained on EPOLLOUT
+struct Outbound {
+    std::vector<unsigned char> buf;
+    size_t head {0};
+    // end offset in buf and enqueue time of each queued packet
+    std::vector<std::pair<size_t, uint64_t>> pending;
+    size_t pending_head {0};
+    size_t max_size {0};
 
+    // enqueue -> last byte written, per packet
+    Session_Histogram delays;
 
-struct Packet {
-    unsigned char payload[1024];
-    unsigned payload_size;
-    unsigned answer_tag;
-    unsigned char vars[8];
-    // array of { operator, variable } pairs
-    unsigned char actions[8][2];
+    // still queued at shutdown, after draining, cf. Sender::drain_backlog()
+    size_t discarded_msgs {0};
+    size_t discarded_bytes {0};
 
-    void apply_variables(const Var_Decls &decls, const Vars &global_vars, Vars &vars);
+    size_t size() const { return buf.size() - head; }
+    bool empty() const { return head == buf.size(); }
 };
 
-struct Session {
-    uint64_t start_off_ns {0};
+// The fields that are touched on each send come first and the struct
+// is cache line aligned (128 bytes), thus they share the first line of
+// each element. The session variables are stored separately,
+// cf. Sender::vars(). The optional state is only allocated when the
+// mode needs it.
+struct alignas(64) Session {
+    // absolute intended time of the next message, i.e. advanced by
+    // interval_ns (as modulated by the load profile) for each message
+    uint64_t next_ns {0};
     uint64_t interval_ns {0};
-
-    Vars vars;
+    // state of the Poisson arrivals generator
+    uint64_t rng {0};
 
     int fd {0};
-    int tfd {0};
-
     unsigned flow_pos {0};
 
-    unsigned packet_counter {0};
+    // pre-rendered patch regions of the next main flow packets, i.e.
+    // slot i belongs to the packet at flow_pos + i
+    unsigned char ring_head {0};
+    unsigned char ring_count {0};
+
+    // a record in the metrics segment
+    Session_Metrics *metrics {nullptr};
+
+    // only allocated in correlation mode
+    std::unique_ptr<Stamp_Table> stamps;
+    // only allocated after the first short write in non-blocking mode
+    std::unique_ptr<Outbound> outq;
+
+    // only allocated with kernel timestamping, i.e. start time of each
+    // main flow write, keyed by write index << 32 | (tx_bytes - 1)
+    std::unique_ptr<Stamp_Table> writes;
+    uint64_t tx_writes {0};
+    uint64_t tx_bytes {0};
+
+    // only allocated in closed-loop mode
+    std::unique_ptr<Credit_Window> window;
+    // only allocated if the last read of the login also returned bytes
+    // after the last answer, they are handed over to the receiver
+    std::unique_ptr<std::vector<unsigned char>> leftover;
+
+    unsigned id {0};
+    // index of the receiver thread that processes the responses
+    unsigned receiver {0};
+    uint64_t start_off_ns {0};
+
+    // responses, in the metrics segment
+    Counter<uint64_t> *received {nullptr};
+};
+static_assert(sizeof(Session) == 128, "Session should span two cache lines");
+
+// An element of the sessions array, i.e. either one explicitly listed
+// session or a generator for count sessions. In a generator, a
+// { start = X, step = Y } value yields X + i * Y and a '{i}' in a
+// string value is replaced by i, for i = 0 .. count-1.
+//
+// It's compiled once, when the config is parsed, and expanded directly
+// into the variable bytes of each session (cf. Var_Decls::local_offs)
+// by the sender thread the session is assigned to.
+struct Session_Generator {
+    // session ids are 32 bit
+    static constexpr uint64_t MAX_SESSIONS = UINT32_MAX;
+
+    struct Var {
+        unsigned off {0};
+        unsigned size {0};
+        // a constant, pre-rendered
+        std::vector<unsigned char> bytes;
+        bool sequence {false};
+        uint64_t start {0};
+        uint64_t step {0};
+        // a string pattern, split at its '{i}' placeholders
+        std::vector<std::string> parts;
+    };
+    // id of the first generated session
+    uint64_t first {0};
+    uint64_t count {1};
+    std::vector<Var> vars;
+
+    // tmp: scratch space for the patterns, cf. config.cc
+    void expand(uint64_t i, unsigned char *dst, std::string &tmp) const;
 };
 
 struct Sender_Config {
     Vars vars;
     Var_Decls var_decls;
 
+    // ordered by Session_Generator::first
+    std::vector<Session_Generator> generators;
+
+    // the packet templates are shared by all senders
+    std::vector<Packet> prelude_flow;
+    std::vector<Packet> main_flow;
+
+    // location of the correlation variable in the request payloads,
+    // size == 0 disables correlation
+    Field correlation;
+
+    Load_Profile profile;
+
+    // closed-loop mode, i.e. a session sends its next request as soon
+    // as less than window requests are outstanding; the window sizes are
+    // swept through, each for window_phase_ns (0: until the end)
+    std::vector<unsigned> windows;
+    uint64_t window_phase_ns {0};
+
+    // saturation mode, i.e. no timers, each sender writes batches of
+    // flood_batch main flow packets (with one writev) to its sessions in turn
+    bool flood {false};
+    unsigned flood_batch {16};
+
+    // send missed ticks after a late timer wakeup instead of dropping them
+    bool catch_up {false};
 
-    int receiver_pipe_in_fd {0};
+    // maximum number of sessions that are concurrently connecting/logging in
+    unsigned max_inflight_logins {64};
+
+    // number of main flow packets that are rendered ahead per session,
+    // 0 disables pre-rendering
+    unsigned prerender {0};
+
+    // otherwise, the session sockets are non-blocking and what doesn't
+    // fit into the socket buffer is queued per session, up to
+    // max_queued_bytes (further messages are dropped and reported);
+    // flood mode always uses blocking writes
+    bool blocking_writes {false};
+    size_t max_queued_bytes {1024 * 1024};
+
+    // io_uring backend (io.backend), i.e. the due sends of one wake-up
+    // are submitted as one batch, no per-session outbound queue
+    bool io_uring {false};
+    unsigned ring_entries {256};
+
+    // set when some variable is stamped with CLOCK_TAI
+    bool tai_stamps {false};
+
+    // write-ends of the receiver pipes, indexed by Session::receiver
+    std::vector<int> receiver_pipe_in_fds;
 };
 
 struct Sender {
@@ -70,12 +199,30 @@ struct Sender {
     const Sender_Config &cfg;
     const Receiver_Config &receiver_cfg;
 
-    // each sender gets a copy of the flow since packets
-    // are modified via variables in each sender
-    std::vector<Packet> prelude_flow;
-    std::vector<Packet> main_flow;
+    // scratch space for rendering the patch region of a packet
+    std::vector<unsigned char> patch_buf;
+
+    // prerender slots of all sessions, cf. Session::ring_head
+    std::vector<unsigned char> ring;
+    size_t ring_slot_len {0};
+    // sessions whose ring needs a refill during the next idle time
+    std::vector<size_t> refill;
 
     std::vector<Session> sessions;
+    // next deadline of each session
+    Timer_Heap timers;
+
+    // local variables of all sessions, i.e. Var_Decls::local_size
+    // bytes per session, in session order
+    std::vector<unsigned char> var_bytes;
+
+    // expands the session generators into var_bytes
+    void generate_vars();
+
+    unsigned char *vars(size_t idx)
+    {
+        return var_bytes.data() + idx * cfg.var_decls.local_size;
+    }
 
     const char *host {nullptr};
     const char *port {nullptr};
@@ -85,31 +232,141 @@ struct Sender {
     unsigned core {0};
     unsigned priority {0};
 
+    // CLOCK_TAI - CLOCK_REALTIME, refreshed once per wake-up
+    uint64_t tai_off_ns {0};
+
+    // busy-poll the clock instead of waiting for timer wake-ups
+    bool spin {false};
+
+    // the sender's epoll instance
+    int efd {-1};
+    // number of sessions with queued bytes, cf. Outbound
+    unsigned backlogged {0};
+
+    // during the main flow phase, i.e. for comparing the I/O backends
+    uint64_t syscalls {0};
+    uint64_t cpu_ns {0};
+
     size_t no_of_sends {0};
-    size_t send_count {0};
 
-    unsigned timer_was_late {0};
+    // send counts and histograms, i.e. a record in the metrics segment
+    Sender_Metrics *metrics {nullptr};
+
+    // connect() -> connection established
+    Histogram connect_hist;
+    // first prelude packet -> last prelude answer
+    Histogram login_hist;
+    // earliest due deadline -> timer wake-up (or detection in spin mode)
+    Histogram wakeup_hist;
+    // deadline -> completion of the write call, for timer driven sends
+    Histogram completion_hist;
+    // outbound queueing delays of all sessions, cf. Outbound::delays
+    Histogram queue_delay_hist;
 
     unsigned main_flow_count {0};
 
+    // start of the main flow phase, i.e. the next full minute
+    uint64_t epoch_ns {0};
+    // intended and actual send times, cf. Load_Profile::report_interval_ns
+    Rate_Log offered;
+    Rate_Log achieved;
+
 
     void *main();
 
     void spawn(bool realtime, bool affinity);
 
+    void establish();
+    void send_prelude(Session &session, unsigned step);
+    void write_packet(int fd, const Packet &packet, const unsigned char *patch);
+    void write_or_queue(Session &session, const Packet &packet,
+            const unsigned char *patch, uint64_t t0);
+    void drain(Session &session);
+    void drain_backlog(uint64_t timeout_ns);
+    void watch_out(Session &session, bool on);
+    void stamp_packet(const Packet &packet, unsigned char *patch,
+            uint64_t now, uint64_t sched_ns);
+    void update_tai_off(uint64_t now);
+    void log_write(Session &session, size_t n, uint64_t t0);
+    unsigned char *ring_slot(size_t idx, unsigned i);
+    void fill_ring(size_t idx);
+    void refill_rings();
+    void activate(Session &session, int efd);
+
+    uint64_t send(Session &session, uint64_t sched_ns);
+    bool fire_due(uint64_t now);
+    void arm_timer(int tfd);
+    void shutdown_sessions();
+    void *spin_loop(int efd, int tfd);
+
+    // closed-loop mode, cf. Sender_Config::windows
+    int wake_fd {-1};
+    unsigned window_phase {0};
+    uint64_t phase_start_ns {0};
+    // actual duration of each window phase
+    std::vector<uint64_t> phase_durations;
+
+    void *closed_loop(int efd, int tfd);
+
+    // flood mode, cf. Sender_Config::flood
+    uint64_t flood_bytes {0};
+    uint64_t flood_wall_ns {0};
+    uint64_t flood_cpu_ns {0};
+
+    void *flood_loop(int efd, int tfd);
+    bool next_phase(int tfd);
+    bool pump(Session &session);
+    bool pump_all();
+    void finish_phases();
+    bool dispatch(const struct epoll_event &ev, int tfd);
+
+    // only allocated in inline receive mode
+    std::unique_ptr<Receiver> rx;
+
+    void *run(int efd, int tfd);
+
+    // io_uring backend, cf. uring.cc
+    Uring_Sender *uring {nullptr};
+
+    void *uring_loop(int efd);
+    void uring_send(Session &session, const Packet &packet, const unsigned char *patch,
+            uint64_t t0, uint64_t sched_ns);
+    bool uring_ready(const Session &session) const;
+    void uring_wait();
+    void uring_reap();
+    void uring_flush();
+
 };
 
 
 struct Client {
     Sender_Config sender_cfg;
     Receiver_Config receiver_cfg;
+    Stats_Config stats_cfg;
+
+    // empty: the metrics aren't shared with other processes
+    std::string metrics_file;
+    Metrics_Segment metrics;
+
+    // record mode, i.e. each receiver thread writes its PDUs to
+    // record_file.N (N: receiver index), pre-allocated to record_size
+    std::string record_file;
+    uint64_t record_size {0};
 
     std::vector<Sender> senders;
 
-    Receiver receiver {receiver_cfg};
+    std::vector<Receiver> receivers;
+    // otherwise the sessions of one sender are assigned to the same receiver
+    bool shard_by_session {false};
 
 
     void parse_config(const char *filename);
+
+    // assigns sessions to receivers and connects them with pipes
+    void setup_receivers();
+    // maps the metrics segment and assigns its records to the threads,
+    // creates the record files
+    void setup_metrics();
 };
 
 #endif
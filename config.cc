@@ -11,7 +11,10 @@
 #include <unordered_map>
 #include <string>
 #include <string_view>
+#include <charconv>
+#include <optional>
 #include <string.h>
+#include <sys/resource.h> // getrlimit
 
 #include <iostream>
 
@@ -40,11 +43,19 @@ static void parse_vars(const toml::table &tbl, Var_Decls &decls,
         }
         toml::node_view q{p.second};
         decls.sizes[i] = q["size"].value<unsigned>().value();
+        if (i < 8 && decls.sizes[i] > sizeof Vars::v[0])
+            throw std::runtime_error("global variable too large: " + std::string(p.first));
         decls.offs[i] = q["off"].value<unsigned>().value();
+        if (auto c = q["clock"].value<std::string_view>()) {
+            if (i < 8)
+                throw std::runtime_error("clock variable can't be global: " + std::string(p.first));
+            decls.clocks[i] = str2clock(*c);
+        }
 
         var2id[p.first] = i;
 
     }
+    decls.layout();
 }
 
 static void store_int(uint64_t i, unsigned size, unsigned char *s)
@@ -84,39 +95,110 @@ static void store_str(const std::string_view &v, unsigned size, unsigned char *s
     memcpy(s, v.data(), l);
 }
 
-static void parse_ass(const toml::node_view<const toml::node> &tbl, bool global, const Var_Decls &decls,
-        std::unordered_map<std::string, unsigned> &var2id, Vars &vars)
+static void store_value(const toml::node &v, const std::string_view &name,
+        unsigned size, unsigned char *s)
+{
+    switch (v.type()) {
+        case toml::node_type::integer:
+            store_int(v.value<uint64_t>().value(), size, s);
+            break;
+        case toml::node_type::string:
+            store_str(v.value<std::string_view>().value(), size, s);
+            break;
+        default:
+            throw std::runtime_error("Type not implemented for: " + std::string(name));
+            break;
+    }
+}
+
+static void parse_globals(const toml::node_view<const toml::node> &tbl, const Var_Decls &decls,
+        const std::unordered_map<std::string, unsigned> &var2id, Vars &vars)
 {
-    unsigned off = global ? 0 : 8;
     for (auto &p : *tbl.as_table()) {
         auto x = var2id.find(p.first);
         if (x == var2id.end())
             throw std::runtime_error("Couldn't find variable decl: " + std::string(p.first));
-
-        if (!global && x->second < 8)
-            throw std::runtime_error("accessing a global variable from a local context");
-        unsigned i = x->second - off;
-        if (i > 7)
+        if (x->second > 7)
             throw std::runtime_error("accessing a local variable from a global context");
+        store_value(p.second, p.first, decls.sizes[x->second], vars.v[x->second]);
+    }
+}
 
-        //std::cerr << "dbg: writing " << p.first << " to slot: " << i << '\n';
-
-        switch (p.second.type()) {
-            case toml::node_type::integer:
-                store_int(p.second.value<uint64_t>().value(), decls.sizes[x->second],
-                        vars.v[i]);
-                break;
-            case toml::node_type::string:
-                store_str(p.second.value<std::string_view>().value(), decls.sizes[x->second],
-                        vars.v[i]);
-                break;
-            default:
-                throw std::runtime_error("Type not implemented for: " + std::string(p.first));
-                break;
+void Session_Generator::expand(uint64_t i, unsigned char *dst, std::string &tmp) const
+{
+    for (const Var &v : vars) {
+        unsigned char *s = dst + v.off;
+        if (v.sequence) {
+            store_int(v.start + i * v.step, v.size, s);
+        } else if (!v.parts.empty()) {
+            char b[24];
+            char *e = std::to_chars(b, b + sizeof b, i).ptr;
+            tmp = v.parts[0];
+            for (size_t j = 1; j < v.parts.size(); ++j) {
+                tmp.append(b, e);
+                tmp += v.parts[j];
+            }
+            store_str(tmp, v.size, s);
+        } else {
+            memcpy(s, v.bytes.data(), v.size);
         }
+    }
+}
 
+static Session_Generator parse_generator(const toml::node &node, const Var_Decls &decls,
+        const std::unordered_map<std::string, unsigned> &var2id)
+{
+    const toml::table *tblP = node.as_table();
+    if (!tblP)
+        throw std::runtime_error("sessions element is not a table");
+    const toml::table &tbl = *tblP;
+
+    Session_Generator g;
+    bool generator = tbl.contains("count");
+    if (generator) {
+        auto n = tbl["count"].value<int64_t>();
+        if (!n || *n < 1)
+            throw std::runtime_error("sessions: count must be a positive integer");
+        if (uint64_t(*n) > Session_Generator::MAX_SESSIONS) {
+            std::ostringstream o;
+            o << "sessions: count " << *n << " exceeds the maximum of "
+                << Session_Generator::MAX_SESSIONS << " sessions";
+            throw std::runtime_error(o.str());
+        }
+        g.count = *n;
+    }
+    for (auto &p : tbl) {
+        if (p.first == "count")
+            continue;
+        auto x = var2id.find(p.first);
+        if (x == var2id.end())
+            throw std::runtime_error("Couldn't find variable decl: " + std::string(p.first));
+        if (x->second < 8)
+            throw std::runtime_error("accessing a global variable from a local context");
 
+        Session_Generator::Var v;
+        v.off = decls.local_offs[x->second];
+        v.size = decls.sizes[x->second];
+        std::optional<std::string_view> str = p.second.value<std::string_view>();
+        if (const toml::table *t = p.second.as_table()) {
+            auto start = (*t)["start"].value<int64_t>();
+            if (!start)
+                throw std::runtime_error("sessions: " + std::string(p.first) + ".start is missing");
+            v.sequence = true;
+            v.start = *start;
+            v.step = (*t)["step"].value_or(int64_t(1));
+        } else if (generator && str && str->find("{i}") != std::string_view::npos) {
+            std::string_view s = *str;
+            for (size_t i; (i = s.find("{i}")) != std::string_view::npos; s.remove_prefix(i + 3))
+                v.parts.emplace_back(s.substr(0, i));
+            v.parts.emplace_back(s);
+        } else {
+            v.bytes.resize(v.size);
+            store_value(p.second, p.first, v.size, v.bytes.data());
+        }
+        g.vars.push_back(std::move(v));
     }
+    return g;
 }
 
 struct BCD_Table {
@@ -148,20 +230,18 @@ static void parse_packet(const std::string_view &s, Packet &p)
 {
     if (s.size() % 2)
         throw std::runtime_error("packet string ends with a half byte");
-    if (s.size() > sizeof p.payload)
-        throw std::runtime_error("packet payload too large");
+    p.payload.resize(s.size() / 2);
     unsigned k = 0;
     for (size_t i = 0; i < s.size(); i += 2) {
         p.payload[k++] = bcd_table.lookup(s[i], s[i+1]);
     }
-    p.payload_size = k;
 }
 
 
 
 static void parse_flow(const toml::array &pkts,
-        std::unordered_map<std::string, unsigned> var2id,
-        std::vector<Packet> &flow)
+        const std::unordered_map<std::string, unsigned> &var2id,
+        const Sender_Config &cfg, std::vector<Packet> &flow)
 {
     for (const toml::node &pkt : pkts) {
         flow.emplace_back();
@@ -205,7 +285,11 @@ static void parse_flow(const toml::array &pkts,
                 if (k >= sizeof p.actions / sizeof p.actions[0])
                     throw std::runtime_error("too many actions specified in packet");
                 p.actions[k][0] = 1 + static_cast<unsigned>(str2operator(act["op"].value<std::string_view>().value()));
-                unsigned id = var2id[act["name"].value<std::string>().value()];
+                std::string name = act["name"].value<std::string>().value();
+                auto i = var2id.find(name);
+                if (i == var2id.end())
+                    throw std::runtime_error("unknown variable in action: " + name);
+                unsigned id = i->second;
                 if (id < sizeof Vars::v / sizeof Vars::v[0])
                     throw std::runtime_error("can't modify global variable with action");
                 p.actions[k][1] = 1 + id;
@@ -217,6 +301,8 @@ static void parse_flow(const toml::array &pkts,
             p.answer_tag = **answer_tag;
         }
 
+        p.compile(cfg.var_decls, cfg.vars);
+
 
     }
 }
@@ -253,17 +339,107 @@ static void parse_field(const toml::node_view<const toml::node> &tbl, const char
     set_or_fail(f.size, node, "size", prefix);
 }
 
-static void parse_receiver(const toml::node_view<const toml::node> &tbl, Receiver &rec,
-        Receiver_Config &cfg)
+static void parse_receiver(const toml::node_view<const toml::node> &tbl,
+        std::vector<Receiver> &receivers, bool &shard_by_session, Receiver_Config &cfg)
 {
     const char *prefix = "receiver.";
-    set_or_fail(rec.core, tbl, "core", prefix);
+    cfg.inline_receive = tbl["inline"].value_or(false);
+    if (cfg.inline_receive) {
+        // no receiver threads
+    } else if (auto cores = tbl["cores"].as_array()) {
+        if (cores->empty())
+            throw std::runtime_error("receiver.cores is empty");
+        receivers.reserve(cores->size());
+        for (const toml::node &node : *cores) {
+            receivers.emplace_back(cfg);
+            receivers.back().core = node.value<unsigned>().value();
+        }
+    } else {
+        receivers.emplace_back(cfg);
+        set_or_fail(receivers.back().core, tbl, "core", prefix);
+    }
+    std::string shard = tbl["shard"].value_or(std::string("sender"));
+    if (shard == "session")
+        shard_by_session = true;
+    else if (shard != "sender")
+        throw std::runtime_error("unknown receiver.shard: " + shard);
+
     set_or_fail(cfg.error_msg_off, tbl, "error_msg_off", prefix);
     set_or_fail(cfg.error_tag, tbl, "error_tag", prefix);
 
     parse_field(tbl, "len", cfg.len, prefix);
     parse_field(tbl, "tag", cfg.tag, prefix);
     parse_field(tbl, "error_msg_len", cfg.error_msg_len, prefix);
+    if (tbl["correlation"])
+        parse_field(tbl, "correlation", cfg.correlation, prefix);
+    cfg.session_latencies = tbl["session_latencies"].value_or(true);
+}
+
+static void parse_profile(const toml::node_view<const toml::node> &tbl, Load_Profile &p)
+{
+    const char *prefix = "sender.profile.";
+    std::string shape = tbl["shape"].value_or(std::string("constant"));
+    if (shape == "constant") {
+        p.shape = Load_Profile::Shape::CONSTANT;
+    } else if (shape == "ramp") {
+        p.shape = Load_Profile::Shape::RAMP;
+        set_or_fail(p.from, tbl, "from", prefix);
+        set_or_fail(p.to, tbl, "to", prefix);
+        set_or_fail(p.duration_ns, tbl, "duration_ns", prefix);
+        if (p.from <= 0 || p.to <= 0)
+            throw std::runtime_error("sender.profile.from/to must be positive");
+        if (!p.duration_ns)
+            throw std::runtime_error("sender.profile.duration_ns must be positive");
+    } else if (shape == "step") {
+        p.shape = Load_Profile::Shape::STEP;
+        const toml::array *steps = tbl["steps"].as_array();
+        if (!steps || steps->empty())
+            throw std::runtime_error("sender.profile.steps is missing or empty");
+        for (const toml::node &node : *steps) {
+            double x = node.value<double>().value_or(0);
+            if (x <= 0)
+                throw std::runtime_error("sender.profile.steps must be positive");
+            p.steps.push_back(x);
+        }
+        set_or_fail(p.step_ns, tbl, "step_ns", prefix);
+        if (!p.step_ns)
+            throw std::runtime_error("sender.profile.step_ns must be positive");
+    } else if (shape == "sine") {
+        p.shape = Load_Profile::Shape::SINE;
+        set_or_fail(p.amplitude, tbl, "amplitude", prefix);
+        set_or_fail(p.period_ns, tbl, "period_ns", prefix);
+        if (p.amplitude < 0 || p.amplitude >= 1)
+            throw std::runtime_error("sender.profile.amplitude must be in [0, 1)");
+        if (!p.period_ns)
+            throw std::runtime_error("sender.profile.period_ns must be positive");
+    } else {
+        throw std::runtime_error("unknown sender.profile.shape: " + shape);
+    }
+
+    std::string arrivals = tbl["arrivals"].value_or(std::string("fixed"));
+    if (arrivals == "poisson")
+        p.arrivals = Load_Profile::Arrivals::POISSON;
+    else if (arrivals != "fixed")
+        throw std::runtime_error("unknown sender.profile.arrivals: " + arrivals);
+
+    p.seed = tbl["seed"].value_or(uint64_t(0));
+    p.report_interval_ns = tbl["report_interval_ns"].value_or(uint64_t(1000000000));
+}
+
+static void parse_correlation(const toml::node_view<const toml::node> &tbl,
+        const std::unordered_map<std::string, unsigned> &var2id,
+        const Var_Decls &decls, Field &f)
+{
+    auto name = tbl["correlation"].value<std::string>();
+    if (!name)
+        return;
+    auto x = var2id.find(*name);
+    if (x == var2id.end())
+        throw std::runtime_error("unknown sender.correlation variable: " + *name);
+    if (x->second < sizeof Vars::v / sizeof Vars::v[0])
+        throw std::runtime_error("sender.correlation must be a local variable");
+    f.off = decls.offs[x->second];
+    f.size = decls.sizes[x->second];
 }
 
 void Client::parse_config(const char *filename)
@@ -284,8 +460,10 @@ void Client::parse_config(const char *filename)
 
     std::unordered_map<std::string, unsigned> var2id;
     parse_vars(tbl, sender_cfg.var_decls, var2id);
+    for (auto c : sender_cfg.var_decls.clocks)
+        sender_cfg.tai_stamps |= c == Stamp_Clock::TAI;
 
-    parse_ass(tbl["global"], true, sender_cfg.var_decls, var2id, sender_cfg.vars);
+    parse_globals(tbl["global"], sender_cfg.var_decls, var2id, sender_cfg.vars);
 
     for (const toml::node &node : *cores) {
         senders.emplace_back(sender_cfg, receiver_cfg);
@@ -294,16 +472,19 @@ void Client::parse_config(const char *filename)
         sender.core = node.value<unsigned>().value();
         sender.priority = tbl["sender"]["priority"].value_or(0u);
 
-        if (auto t = tbl["flow"]["prelude"].as_array())
-            parse_flow(*t, var2id, sender.prelude_flow);
-        else
-            throw std::runtime_error("flow.prelude is missing");
-        if (auto t = tbl["flow"]["main"].as_array())
-            parse_flow(*t, var2id, sender.main_flow);
-        else
-            throw std::runtime_error("flow.main is missing");
     }
 
+    if (auto t = tbl["flow"]["prelude"].as_array())
+        parse_flow(*t, var2id, sender_cfg, sender_cfg.prelude_flow);
+    else
+        throw std::runtime_error("flow.prelude is missing");
+    if (auto t = tbl["flow"]["main"].as_array())
+        parse_flow(*t, var2id, sender_cfg, sender_cfg.main_flow);
+    else
+        throw std::runtime_error("flow.main is missing");
+    if (sender_cfg.main_flow.empty())
+        throw std::runtime_error("flow.main is empty");
+
     const toml::array *sessions = tbl["sessions"].as_array();
     if (!sessions)
         throw std::runtime_error("no sessions defined!");
@@ -316,26 +497,156 @@ void Client::parse_config(const char *filename)
         throw std::runtime_error("no sender.session.start_off_inc_ns specified");
     uint64_t start_off_ns = tbl["sender"]["session"]["start_off_ns"].value<uint64_t>().value_or(0);
 
+    if (tbl["sender"]["profile"])
+        parse_profile(tbl["sender"]["profile"], sender_cfg.profile);
+    if (auto w = tbl["sender"]["window"]) {
+        if (auto ws = w.as_array()) {
+            for (const toml::node &node : *ws)
+                sender_cfg.windows.push_back(node.value<unsigned>().value_or(0));
+        } else {
+            sender_cfg.windows.push_back(w.value<unsigned>().value_or(0));
+        }
+        for (unsigned x : sender_cfg.windows)
+            if (!x || x > Credit_Window::MAX) {
+                std::ostringstream o;
+                o << "sender.window must be in [1, " << Credit_Window::MAX << ']';
+                throw std::runtime_error(o.str());
+            }
+        if (sender_cfg.windows.empty())
+            throw std::runtime_error("sender.window is empty");
+        sender_cfg.window_phase_ns = tbl["sender"]["window_phase_ns"].value_or(uint64_t(0));
+        if (sender_cfg.windows.size() > 1 && !sender_cfg.window_phase_ns)
+            throw std::runtime_error("sweeping sender.window requires sender.window_phase_ns");
+        if (sender_cfg.windows.size() > 255)
+            throw std::runtime_error("too many sender.window sizes");
+        if (tbl["sender"]["profile"])
+            throw std::runtime_error("sender.profile doesn't apply to closed-loop mode");
+        receiver_cfg.window_phases = sender_cfg.windows.size();
+    }
+    receiver_cfg.timestamping = tbl["sender"]["timestamping"].value_or(false);
+
+    metrics_file = tbl["metrics"]["file"].value_or(std::string());
+    record_file = tbl["record"]["file"].value_or(std::string());
+    record_size = tbl["record"]["size"].value_or(uint64_t(256) * 1024 * 1024);
+    if (tbl["record"] && record_file.empty())
+        throw std::runtime_error("no record.file specified");
+
+    if (auto stats = tbl["stats"]) {
+        stats_cfg.interval_ns = stats["interval_ns"].value_or(uint64_t(1000000000));
+        std::string format = stats["format"].value_or(std::string("jsonl"));
+        if (format == "csv")
+            stats_cfg.csv = true;
+        else if (format != "jsonl")
+            throw std::runtime_error("unknown stats.format: " + format);
+        stats_cfg.filename = stats["file"].value_or(std::string());
+    }
+    sender_cfg.flood = tbl["sender"]["flood"].value_or(false);
+    sender_cfg.flood_batch = tbl["sender"]["flood_batch"].value_or(16u);
+    if (!sender_cfg.flood_batch || sender_cfg.flood_batch > 256)
+        throw std::runtime_error("sender.flood_batch must be in [1, 256]");
+    if (sender_cfg.flood && (!sender_cfg.windows.empty() || tbl["sender"]["profile"]))
+        throw std::runtime_error("sender.flood excludes sender.window and sender.profile");
+    // the kernel stamps a whole batch as one write, whereas the
+    // responses are paired with the writes one by one
+    if (sender_cfg.flood && receiver_cfg.timestamping)
+        throw std::runtime_error("sender.flood excludes sender.timestamping");
+    sender_cfg.catch_up = tbl["sender"]["catch_up"].value_or(false);
+    sender_cfg.max_inflight_logins = tbl["sender"]["max_inflight_logins"].value_or(64u);
+    if (!sender_cfg.max_inflight_logins)
+        throw std::runtime_error("sender.max_inflight_logins must be positive");
+    sender_cfg.prerender = tbl["sender"]["prerender"].value_or(0u);
+    if (sender_cfg.prerender > 255)
+        throw std::runtime_error("sender.prerender must be <= 255");
+    // the flood loop renders each batch itself
+    if (sender_cfg.flood && sender_cfg.prerender)
+        throw std::runtime_error("sender.flood excludes sender.prerender");
+    sender_cfg.blocking_writes = tbl["sender"]["blocking_writes"].value_or(false);
+    sender_cfg.max_queued_bytes = tbl["sender"]["max_queued_bytes"].value_or(uint64_t(1024 * 1024));
+    if (!sender_cfg.max_queued_bytes)
+        throw std::runtime_error("sender.max_queued_bytes must be positive");
+
     unsigned session_limit = tbl["sender"]["sessions"].value<unsigned>().value_or(unsigned(-1));
 
-    unsigned i = 0;
-    unsigned k = 0;
+    std::vector<Session_Generator> &gens = sender_cfg.generators;
+    gens.reserve(sessions->size());
+    uint64_t total = 0;
     for (const toml::node &node : *sessions) {
-        if (k >= session_limit)
-            break;
-        senders[i].sessions.emplace_back();
-        senders[i].sessions.back().start_off_ns = start_off_ns;
-        senders[i].sessions.back().interval_ns = interval_ns;
-        parse_ass(toml::node_view{node}, false, sender_cfg.var_decls, var2id,
-                senders[i].sessions.back().vars);
+        gens.push_back(parse_generator(node, sender_cfg.var_decls, var2id));
+        gens.back().first = total;
+        total += gens.back().count;
+        if (total > Session_Generator::MAX_SESSIONS) {
+            std::ostringstream o;
+            o << "sessions: more than " << Session_Generator::MAX_SESSIONS
+                << " sessions in total";
+            throw std::runtime_error(o.str());
+        }
+    }
+
+    size_t no_sessions = std::min<uint64_t>(total, session_limit);
+    // each session needs a socket, thus more sessions can't be established anyway
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY
+            && no_sessions > rl.rlim_cur) {
+        std::ostringstream o;
+        o << "sessions: " << no_sessions << " sessions exceed the open file limit of "
+            << rl.rlim_cur << " (cf. ulimit -n)";
+        throw std::runtime_error(o.str());
+    }
+
+    // The sessions are distributed round-robin. Their variables are
+    // expanded later, by each sender thread, cf. Sender::generate_vars().
+    for (size_t j = 0; j < senders.size(); ++j)
+        senders[j].sessions.reserve(no_sessions / senders.size() + 1);
+    unsigned i = 0;
+    for (size_t k = 0; k < no_sessions; ++k) {
+        Sender &sender = senders[i];
+        sender.sessions.emplace_back();
+        sender.sessions.back().id = k;
+        sender.sessions.back().start_off_ns = start_off_ns;
+        sender.sessions.back().interval_ns = interval_ns;
 
         start_off_ns += start_off_inc_ns;
         i = (i + 1) % senders.size();
-        ++k;
     }
 
 
-    parse_receiver(tbl["receiver"], receiver, receiver_cfg);
+    parse_receiver(tbl["receiver"], receivers, shard_by_session, receiver_cfg);
+    // flood writes block and responses would only be read between
+    // the rounds, thus a server that blocks on writing them deadlocks
+    if (sender_cfg.flood && receiver_cfg.inline_receive)
+        throw std::runtime_error("sender.flood excludes receiver.inline");
+
+    parse_correlation(tbl["sender"], var2id, sender_cfg.var_decls, sender_cfg.correlation);
+    if (!sender_cfg.correlation.size != !receiver_cfg.correlation.size)
+        throw std::runtime_error("correlation mode requires both sender.correlation "
+                "and receiver.correlation");
+
+    std::string backend = tbl["io"]["backend"].value_or(std::string("epoll"));
+    if (backend == "io_uring") {
+#ifndef TCPLOADGEN_URING
+        throw std::runtime_error("io.backend: built without io_uring support (liburing not found)");
+#endif
+        if (receiver_cfg.inline_receive || !sender_cfg.windows.empty() || sender_cfg.flood
+                || receiver_cfg.timestamping)
+            throw std::runtime_error("io.backend = 'io_uring' doesn't support receiver.inline, "
+                    "sender.window, sender.flood or sender.timestamping");
+        sender_cfg.io_uring = true;
+        receiver_cfg.io_uring = true;
+    } else if (backend != "epoll") {
+        throw std::runtime_error("unknown io.backend: " + backend);
+    }
+    unsigned entries = tbl["io"]["ring_entries"].value_or(256u);
+    if (!entries || entries > 32768)
+        throw std::runtime_error("io.ring_entries must be in [1, 32768]");
+    sender_cfg.ring_entries = entries;
+    receiver_cfg.ring_entries = entries;
+    receiver_cfg.buffers = tbl["io"]["buffers"].value_or(64u);
+    if (!receiver_cfg.buffers || receiver_cfg.buffers > 32768
+            || (receiver_cfg.buffers & (receiver_cfg.buffers - 1)))
+        throw std::runtime_error("io.buffers must be a power of 2 <= 32768");
+    receiver_cfg.buffer_size = tbl["io"]["buffer_size"].value_or(16384u);
+    if (!receiver_cfg.buffer_size)
+        throw std::runtime_error("io.buffer_size must be positive");
 
     } catch (const toml::parse_error &e) {
         std::ostringstream o;
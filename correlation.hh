@@ -0,0 +1,115 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CORRELATION_HH
+#define CORRELATION_HH
+
+#include "counter.hh"
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+// clock used for all send/receive stamps, i.e. the same clock
+// the session timers are based on
+inline uint64_t stamp_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ul + ts.tv_nsec;
+}
+
+// CPU time consumed by the calling thread
+inline uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ul + ts.tv_nsec;
+}
+
+// Send timestamps of one session, keyed by the correlation value
+// (e.g. a sequence number) of the request.
+//
+// Single writer (the sender thread), single reader (the receiver thread).
+// Each slot is a tiny seqlock such that a reader never pairs a key with
+// the timestamp of a later request that reused the same slot.
+struct Stamp_Table {
+    static constexpr unsigned SLOTS = 64;
+    static constexpr uint64_t INVALID = uint64_t(-1);
+
+    struct Slot {
+        std::atomic<uint64_t> key {INVALID};
+        std::atomic<uint64_t> ts  {0};
+    };
+    Slot slots[SLOTS];
+
+    void put(uint64_t key, uint64_t ts)
+    {
+        put_at(key % SLOTS, key, ts);
+    }
+
+    // returns false if the key isn't (or isn't anymore) in the table
+    bool get(uint64_t key, uint64_t &ts) const
+    {
+        uint64_t k;
+        return get_at(key % SLOTS, k, ts) && k == key;
+    }
+
+    // for when the slot isn't derived from the key
+    void put_at(unsigned slot, uint64_t key, uint64_t ts)
+    {
+        Slot &s = slots[slot];
+        s.key.store(INVALID, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.ts.store(ts, std::memory_order_relaxed);
+        s.key.store(key, std::memory_order_release);
+    }
+
+    // returns false if the slot is empty or is being written
+    bool get_at(unsigned slot, uint64_t &key, uint64_t &ts) const
+    {
+        const Slot &s = slots[slot];
+        key = s.key.load(std::memory_order_acquire);
+        if (key == INVALID)
+            return false;
+        ts = s.ts.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.key.load(std::memory_order_relaxed) == key;
+    }
+};
+
+// Outstanding requests of one session in closed-loop mode, i.e. the
+// receiver releases a credit for each response.
+//
+// Single writer each: the sender advances sent (after storing the stamp),
+// the receiver advances completed.
+struct Credit_Window {
+    static constexpr unsigned MAX = 256;
+
+    std::atomic<uint64_t> sent {0};
+    std::atomic<uint64_t> completed {0};
+
+    // send time and window phase of request i, at index i % MAX
+    uint64_t ts[MAX];
+    unsigned char phase[MAX];
+
+    // eventfd of the owning sender, -1 if it doesn't need a wake-up
+    int wake_fd {-1};
+};
+
+// sent by a sender thread over the pipe to the receiver thread
+// for each established session connection
+struct Conn_Announcement {
+    int fd {-1};
+    unsigned session_id {0};
+    const Stamp_Table *stamps {nullptr};
+    Credit_Window *window {nullptr};
+    Counter<uint64_t> *received {nullptr};
+    // only set with kernel timestamping, cf. Session::writes
+    const Stamp_Table *writes {nullptr};
+    // bytes the server sent after the last login answer, cf. Session::leftover
+    const std::vector<unsigned char> *leftover {nullptr};
+};
+
+#endif
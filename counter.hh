@@ -0,0 +1,36 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef COUNTER_HH
+#define COUNTER_HH
+
+#include <atomic>
+
+// Single-writer counter that other threads may sample concurrently.
+//
+// The owning thread increments it with a relaxed load/store pair,
+// i.e. no locked read-modify-write instruction on the hot path.
+template <typename T>
+struct Counter {
+    std::atomic<T> v {0};
+
+    Counter() = default;
+    // for containers, not meant for concurrent use
+    Counter(const Counter &o) : v(T(o)) {}
+
+    Counter &operator++()
+    {
+        v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return *this;
+    }
+    Counter &operator+=(T x)
+    {
+        v.store(v.load(std::memory_order_relaxed) + x, std::memory_order_relaxed);
+        return *this;
+    }
+    // for gauges
+    void store(T x) { v.store(x, std::memory_order_relaxed); }
+    operator T() const { return v.load(std::memory_order_relaxed); }
+};
+
+#endif
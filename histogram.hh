@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef HISTOGRAM_HH
+#define HISTOGRAM_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear (HDR-style) histogram with fixed memory and constant-time
+// recording.
+//
+// Values below 2**SUB_BITS are counted exactly, above that each
+// power-of-two range is split into 2**(SUB_BITS-1) equally sized
+// buckets, i.e. the relative error is below 2**-(SUB_BITS-1).
+// Values of 2**MAX_BITS and above end up in the last bucket
+// (the exact maximum is tracked separately).
+//
+// Single writer: each thread records into its own instance and the
+// instances are merged after the threads are joined. Other threads
+// may take snapshots concurrently since recording uses relaxed atomic
+// stores (i.e. plain moves on x86).
+template <unsigned SUB_BITS, unsigned MAX_BITS, typename Count = uint64_t>
+struct Log_Histogram {
+    static_assert(SUB_BITS > 1 && SUB_BITS < MAX_BITS && MAX_BITS < 64);
+
+    static constexpr size_t HALF = size_t(1) << (SUB_BITS - 1);
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 2) * HALF;
+
+    Count counts[BUCKETS] {0};
+    uint64_t count {0};
+    uint64_t max {0};
+
+    static size_t index(uint64_t v)
+    {
+        if (v >> MAX_BITS)
+            v = (uint64_t(1) << MAX_BITS) - 1;
+        unsigned msb = 63 - __builtin_clzll(v | 1);
+        unsigned shift = msb < SUB_BITS ? 0 : msb - SUB_BITS + 1;
+        return (size_t(shift) << (SUB_BITS - 1)) + (v >> shift);
+    }
+    // smallest value that maps to bucket i
+    static uint64_t lower(size_t i)
+    {
+        if (i < 2 * HALF)
+            return i;
+        unsigned shift = (i >> (SUB_BITS - 1)) - 1;
+        return uint64_t(i - (size_t(shift) << (SUB_BITS - 1))) << shift;
+    }
+
+    void record(uint64_t v)
+    {
+        Count &c = counts[index(v)];
+        __atomic_store_n(&c, c + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&count, count + 1, __ATOMIC_RELAXED);
+        if (v > max)
+            __atomic_store_n(&max, v, __ATOMIC_RELAXED);
+    }
+
+    // copies a histogram that is concurrently recorded into
+    template <typename H>
+    void snapshot(const H &o)
+    {
+        static_assert(H::BUCKETS == BUCKETS);
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts[i] = __atomic_load_n(&o.counts[i], __ATOMIC_RELAXED);
+        count = __atomic_load_n(&o.count, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&o.max, __ATOMIC_RELAXED);
+    }
+
+    // leaves the values recorded since the o snapshot, max is kept
+    void subtract(const Log_Histogram &o)
+    {
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts[i] -= o.counts[i];
+        count -= o.count;
+    }
+
+    template <typename H>
+    void merge(const H &o)
+    {
+        static_assert(H::BUCKETS == BUCKETS);
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts[i] += o.counts[i];
+        count += o.count;
+        if (o.max > max)
+            max = o.max;
+    }
+
+    // q in [0, 100], returns the highest value equivalent to the
+    // bucket the q-th percentile falls into
+    uint64_t percentile(double q) const
+    {
+        if (!count)
+            return 0;
+        uint64_t k = uint64_t(q / 100 * count + 0.5);
+        if (!k)
+            k = 1;
+        uint64_t c = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            c += counts[i];
+            if (c >= k) {
+                uint64_t v = i + 1 < BUCKETS ? lower(i + 1) - 1 : max;
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+};
+
+// relative error < 1 %, up to ~18 minutes in ns
+using Histogram = Log_Histogram<8, 40>;
+
+// compact variant for per-session statistics, relative error < 7 %
+using Session_Histogram = Log_Histogram<5, 40, uint32_t>;
+
+#endif
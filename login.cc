@@ -0,0 +1,187 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "client.hh"
+
+#include <ixxx/posix.hh>
+#include <ixxx/linux.hh>
+#include <ixxx/socket.hh>
+#include <ixxx/util.hh>
+
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>      // getaddrinfo
+#include <string.h>     // memcpy
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>     // close
+
+
+namespace {
+
+// state of one session while it's being established
+struct Login {
+    bool connecting {true};
+    unsigned step {0};
+    uint64_t start_ns {0};
+
+    // start of a PDU that didn't fit into the last read
+    std::vector<unsigned char> partial;
+};
+
+}
+
+static void throw_errno(const char *what, const char *host, const char *port, int e)
+{
+    std::ostringstream o;
+    o << what << ' ' << host << ':' << port << " (" << e << ')';
+    throw std::runtime_error(o.str());
+}
+
+static int connect_nonblocking(const struct addrinfo *ai, const char *host, const char *port)
+{
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ai->ai_protocol);
+    if (fd == -1)
+        throw_errno("Couldn't create socket for", host, port, errno);
+    int r = connect(fd, ai->ai_addr, ai->ai_addrlen);
+    if (r == -1 && errno != EINPROGRESS) {
+        int e = errno;
+        close(fd);
+        throw_errno("Couldn't connect to", host, port, e);
+    }
+    return fd;
+}
+
+void Sender::send_prelude(Session &session, unsigned step)
+{
+    const Packet &packet = cfg.prelude_flow[step];
+    packet.render(vars(&session - sessions.data()), patch_buf.data());
+    uint64_t now = stamp_now_ns();
+    update_tai_off(now);
+    stamp_packet(packet, patch_buf.data(), now, now);
+    write_packet(session.fd, packet, patch_buf.data());
+}
+
+// Connects all sessions and runs their prelude flows concurrently, i.e.
+// with non-blocking connects and up to max_inflight_logins sessions
+// waiting for a connect or a login answer at the same time.
+//
+// Afterwards, the session sockets are in blocking mode
+// (until activate() switches them, unless blocking_writes).
+void Sender::establish()
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *aiP = nullptr;
+    int r = getaddrinfo(host, port, &hints, &aiP);
+    if (r) {
+        std::ostringstream o;
+        o << "Couldn't resolve " << host << ':' << port << ": " << gai_strerror(r);
+        throw std::runtime_error(o.str());
+    }
+    std::unique_ptr<struct addrinfo, void(*)(struct addrinfo*)> ai(aiP, freeaddrinfo);
+
+    ixxx::util::FD efd ( ixxx::linux::epoll_create1(0) );
+
+    std::vector<Login> logins(sessions.size());
+    unsigned char buf[64*1024];
+
+    size_t next = 0;
+    size_t done = 0;
+    unsigned inflight = 0;
+
+    struct epoll_event evs[64];
+    while (done < sessions.size()) {
+        for (; inflight < cfg.max_inflight_logins && next < sessions.size(); ++next) {
+            Session &session = sessions[next];
+            logins[next].start_ns = stamp_now_ns();
+            session.fd = connect_nonblocking(ai.get(), host, port);
+
+            struct epoll_event ev = { .events = EPOLLOUT,
+                .data = { .u64 = next } };
+            ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, session.fd, &ev);
+            ++inflight;
+        }
+
+        int k = ixxx::linux::epoll_wait(efd, evs, sizeof evs / sizeof evs[0], -1);
+        for (int i = 0; i < k; ++i) {
+            size_t idx = evs[i].data.u64;
+            Session &session = sessions[idx];
+            Login &login = logins[idx];
+
+            if (login.connecting) {
+                int e = 0;
+                socklen_t e_len = sizeof e;
+                ixxx::posix::getsockopt(session.fd, SOL_SOCKET, SO_ERROR, &e, &e_len);
+                if (e)
+                    throw_errno("Couldn't connect to", host, port, e);
+                uint64_t now = stamp_now_ns();
+                connect_hist.record(now - login.start_ns);
+                login.start_ns = now;
+                login.connecting = false;
+
+                // the prelude packets are small enough to not block,
+                // cf. Sender::activate() for the main flow
+                int flags = ixxx::posix::fcntl(session.fd, F_GETFL);
+                ixxx::posix::fcntl(session.fd, F_SETFL, flags & ~O_NONBLOCK);
+
+                struct epoll_event ev = { .events = EPOLLIN,
+                    .data = { .u64 = idx } };
+                ixxx::linux::epoll_ctl(efd, EPOLL_CTL_MOD, session.fd, &ev);
+
+                if (login.step < cfg.prelude_flow.size())
+                    send_prelude(session, login.step);
+            } else {
+                size_t n = login.partial.size();
+                if (n)
+                    memcpy(buf, login.partial.data(), n);
+                ssize_t l = recv(session.fd, buf + n, sizeof buf - n, MSG_DONTWAIT);
+                if (l == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                        continue;
+                    throw_errno("Couldn't receive login answer from", host, port, errno);
+                }
+                if (!l)
+                    throw std::runtime_error("connection closed during login");
+                n += l;
+                // end of the last answer in buf
+                size_t last = 0;
+                size_t m = receiver_cfg.frame(buf, n, sizeof buf,
+                        [this, &session, &login, &buf, &last](const unsigned char *p, size_t l, unsigned t) {
+                            if (login.step >= cfg.prelude_flow.size())
+                                return; // cf. Session::leftover
+                            const Packet &packet = cfg.prelude_flow[login.step];
+                            if (t != packet.answer_tag) {
+                                std::ostringstream o;
+                                o << "Unexpected answer tag: " << t << " (expected: "
+                                    << packet.answer_tag << ')';
+                                throw std::runtime_error(o.str());
+                            }
+                            last = p + l - buf;
+                            if (++login.step < cfg.prelude_flow.size())
+                                send_prelude(session, login.step);
+                        });
+                if (login.step < cfg.prelude_flow.size())
+                    login.partial.assign(buf + m, buf + n);
+                else if (last < n)
+                    // the receiver has to continue framing right after the last answer
+                    session.leftover = std::make_unique<std::vector<unsigned char>>(buf + last, buf + n);
+            }
+
+            if (!login.connecting && login.step == cfg.prelude_flow.size()) {
+                login_hist.record(stamp_now_ns() - login.start_ns);
+                ixxx::linux::epoll_ctl(efd, EPOLL_CTL_DEL, session.fd, nullptr);
+                login.partial = std::vector<unsigned char>();
+                ++login.step; // i.e. done
+                --inflight;
+                ++done;
+            }
+        }
+    }
+}
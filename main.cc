@@ -4,10 +4,13 @@
 
 #include "client.hh"
 
+#include <algorithm>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include <ixxx/posix.hh>
 #include <ixxx/linux.hh>  // prctl
@@ -26,6 +29,7 @@ struct Args {
     size_t no_senders {0};
     size_t no_pkts {0};
     bool timerslack {false};
+    bool spin {false};
     bool set_affinity {true};
 
     void parse(int argc, char **argv);
@@ -42,6 +46,8 @@ void Args::help(std::ostream &o, const char *argv0)
         << "  -A             do NOT set thread CPU affinities\n"
         << "  -c FILENAME    TOML configuration\n"
         << "  -j #SENDERS    number of sender threads\n"
+        << "  -b             busy-poll the clock instead of waiting for timers\n"
+        << "                 (i.e. for isolated cores)\n"
         << "  -h             display this help\n"
         << "  -n #PKTS       packets to send for each sender\n"
         << "  -s             use 1 ns timerslack instead of realtime sched policy\n"
@@ -55,7 +61,7 @@ void Args::parse(int argc, char **argv)
     // '-' prefix: no reordering of arguments, non-option arguments are
     // returned as argument to the 1 option
     // ':': preceding option takes a mandatory argument
-    while ((c = getopt(argc, argv, "-c:j:hn:s")) != -1) {
+    while ((c = getopt(argc, argv, "-Abc:j:hn:s")) != -1) {
         switch (c) {
             case '?':
                 {
@@ -67,6 +73,9 @@ void Args::parse(int argc, char **argv)
             case 'A':
                 set_affinity = false;
                 break;
+            case 'b':
+                spin = true;
+                break;
             case 'c':
                 filename = optarg;
                 break;
@@ -104,6 +113,184 @@ void Args::parse(int argc, char **argv)
 }
 
 
+template <typename H>
+static void print_percentiles(std::ostream &o, const H &h)
+{
+    o << "n=" << h.count;
+    if (!h.count) {
+        o << '\n';
+        return;
+    }
+    for (double q : { 50.0, 90.0, 99.0, 99.9, 99.99 })
+        o << " p" << q << '=' << h.percentile(q);
+    o << " max=" << h.max << '\n';
+}
+
+static void print_latencies(std::ostream &o, const std::vector<const Receiver*> &receivers)
+{
+    auto all = std::make_unique<Histogram>();
+    unsigned unmatched_count = 0;
+    for (auto receiver : receivers) {
+        for (auto &c : receiver->connections) {
+            if (!c.rtts)
+                continue;
+            o << "Round-trip latency (ns) of session " << c.session_id << ": ";
+            print_percentiles(o, *c.rtts);
+        }
+        all->merge(receiver->metrics->rtt_hist);
+        unmatched_count += receiver->metrics->unmatched_count;
+    }
+    o << "Round-trip latency (ns) of all sessions: ";
+    print_percentiles(o, *all);
+    o << "Uncorrelated responses: " << unmatched_count << '\n';
+}
+
+// SO_TIMESTAMPING breakdown, merged over all receivers
+static void print_kernel_stamps(std::ostream &o, const std::vector<const Receiver*> &receivers)
+{
+    const char *names[] = { "User to kernel TX (ns)", "Kernel TX to ACK (ns)",
+        "Wire round-trip, kernel TX to RX (ns)" };
+    Histogram Receiver::*hs[] = { &Receiver::tx_kernel_hist, &Receiver::tx_ack_hist,
+        &Receiver::wire_rtt_hist };
+    for (unsigned i = 0; i < 3; ++i) {
+        auto all = std::make_unique<Histogram>();
+        for (auto receiver : receivers)
+            all->merge(receiver->*hs[i]);
+        o << names[i] << ": ";
+        print_percentiles(o, *all);
+    }
+}
+
+// prints the per-core and the merged percentiles
+static void print_sender_hists(std::ostream &o, const std::vector<Sender> &senders,
+        const char *name, const Histogram &(*h)(const Sender &))
+{
+    auto all = std::make_unique<Histogram>();
+    for (auto &sender : senders) {
+        o << name << " on core " << sender.core << ": ";
+        print_percentiles(o, h(sender));
+        all->merge(h(sender));
+    }
+    o << name << " of all cores: ";
+    print_percentiles(o, *all);
+}
+
+// aggregated over all senders, in messages per second
+static void print_rates(std::ostream &o, const std::vector<Sender> &senders,
+        uint64_t interval_ns)
+{
+    std::vector<uint64_t> offered, achieved;
+    for (auto &sender : senders) {
+        for (auto [log, sum] : { std::make_pair(&sender.offered, &offered),
+                std::make_pair(&sender.achieved, &achieved) }) {
+            if (sum->size() < log->counts.size())
+                sum->resize(log->counts.size());
+            for (size_t i = 0; i < log->counts.size(); ++i)
+                (*sum)[i] += log->counts[i];
+        }
+    }
+    double f = 1e9 / double(interval_ns);
+    size_t n = std::max(offered.size(), achieved.size());
+    offered.resize(n);
+    achieved.resize(n);
+    o << "Offered vs. achieved rate (msg/s) per " << interval_ns << " ns interval:\n";
+    for (size_t i = 0; i < n; ++i)
+        o << "  " << i << ": offered=" << offered[i] * f
+            << " achieved=" << achieved[i] * f << '\n';
+}
+
+// sustained rate and round-trip latencies for each closed-loop window size
+static void print_windows(std::ostream &o, const std::vector<Sender> &senders,
+        const std::vector<const Receiver*> &receivers, const std::vector<unsigned> &windows)
+{
+    for (size_t i = 0; i < windows.size(); ++i) {
+        auto all = std::make_unique<Histogram>();
+        for (auto receiver : receivers)
+            if (i < receiver->window_hists.size())
+                all->merge(receiver->window_hists[i]);
+        uint64_t d = 0;
+        unsigned n = 0;
+        for (auto &sender : senders)
+            if (i < sender.phase_durations.size()) {
+                d += sender.phase_durations[i];
+                ++n;
+            }
+        if (!n)
+            break;
+        d /= n;
+        o << "Closed-loop window " << windows[i] << ": "
+            << all->count * 1e9 / double(d) << " msg/s over " << d << " ns, round-trip latency (ns): ";
+        print_percentiles(o, *all);
+    }
+}
+
+// throughput and the client's own CPU cost in flood mode
+static void print_flood(std::ostream &o, const std::vector<Sender> &senders)
+{
+    for (auto &sender : senders) {
+        uint64_t n = sender.metrics->send_count;
+        if (!sender.flood_wall_ns || !n)
+            continue;
+        double s = sender.flood_wall_ns / 1e9;
+        o << "Flood throughput on core " << sender.core << ": "
+            << n / s << " msg/s, "
+            << sender.flood_bytes / s / 1e6 << " MB/s, CPU "
+            << double(sender.flood_cpu_ns) / n << " ns/msg ("
+            << 100.0 * sender.flood_cpu_ns / sender.flood_wall_ns << " % busy)\n";
+    }
+}
+
+// only the sessions that hit a full socket buffer
+static void print_backpressure(std::ostream &o, const std::vector<Sender> &senders)
+{
+    for (auto &sender : senders) {
+        for (auto &session : sender.sessions) {
+            const Session_Metrics &m = *session.metrics;
+            if (!m.eagain_count && !m.backpressure_drops)
+                continue;
+            o << "Backpressure on session " << session.id << " (core " << sender.core
+                << "): eagain=" << m.eagain_count
+                << " max_queued_bytes=" << (session.outq ? session.outq->max_size : 0)
+                << " dropped=" << m.backpressure_drops;
+            if (session.outq && session.outq->discarded_msgs)
+                o << " discarded_at_shutdown=" << session.outq->discarded_msgs
+                    << " (" << session.outq->discarded_bytes << " bytes)";
+            o << ", queueing delay (ns): ";
+            if (session.outq)
+                print_percentiles(o, session.outq->delays);
+            else
+                o << '\n';
+        }
+    }
+}
+
+// for comparing the epoll and io_uring backends side by side
+static void print_io(std::ostream &o, const std::vector<Sender> &senders,
+        const std::vector<const Receiver*> &receivers, const char *backend)
+{
+    for (auto &sender : senders) {
+        uint64_t n = sender.metrics->send_count;
+        if (!n)
+            continue;
+        o << "I/O (" << backend << ") of sender on core " << sender.core << ": "
+            << sender.syscalls << " syscalls, " << double(sender.syscalls) / n
+            << " per msg, CPU " << double(sender.cpu_ns) / n << " ns/msg\n";
+    }
+    for (auto receiver : receivers) {
+        uint64_t n = receiver->metrics->receive_count;
+        if (!n)
+            continue;
+        o << "I/O (" << backend << ") of receiver on core " << receiver->core << ": "
+            << receiver->syscalls << " syscalls, " << double(receiver->syscalls) / n
+            << " per msg";
+        // inline receivers are accounted to their senders
+        if (receiver->cpu_ns)
+            o << ", CPU " << double(receiver->cpu_ns) / n << " ns/msg";
+        o << '\n';
+    }
+}
+
+
 int main(int argc, char **argv)
 {
     try {
@@ -113,46 +300,105 @@ int main(int argc, char **argv)
         Client client;
 
         client.parse_config(args.filename.c_str());
+        if (args.spin && client.sender_cfg.io_uring)
+            throw std::runtime_error("spinning isn't supported with io.backend = 'io_uring'");
 
         if (args.no_senders)
             while (args.no_senders < client.senders.size())
                 client.senders.pop_back();
 
-        int rw_pipe[2] = {0};
-        ixxx::posix::pipe(rw_pipe);
-
-        client.sender_cfg.receiver_pipe_in_fd = rw_pipe[1];
-        client.receiver.pipe_out_fd = rw_pipe[0];
+        client.setup_receivers();
+        client.setup_metrics();
 
         for (auto &s : client.senders) {
             s.host = args.host.c_str();
             s.port = args.port.c_str();
             s.no_of_sends = args.no_pkts;
+            s.spin = args.spin;
         }
 
-        client.receiver.spawn(args.set_affinity);
+        for (auto &receiver : client.receivers)
+            receiver.spawn(args.set_affinity);
 
         for (auto &sender : client.senders) {
             sender.spawn(!args.timerslack, args.set_affinity);
         }
 
+        Stats_Reporter stats(client.stats_cfg, client.senders, client.receivers);
+        if (client.stats_cfg.interval_ns)
+            stats.spawn();
+
         void *v = nullptr;
         bool success = true;
-        ixxx::posix::pthread_join(client.receiver.thread_id, &v);
-        success = success && !v;
+        for (auto &receiver : client.receivers) {
+            ixxx::posix::pthread_join(receiver.thread_id, &v);
+            success = success && !v;
+        }
 
         for (auto &sender : client.senders) {
             ixxx::posix::pthread_join(sender.thread_id, &v);
             success = success && !v;
         }
-
-        std::cout << "Received messages: " << client.receiver.receive_count << '\n';
+        if (client.stats_cfg.interval_ns)
+            stats.stop();
+
+        // either the receiver threads or the inline receivers of the senders
+        std::vector<const Receiver*> rxs;
+        for (auto &receiver : client.receivers)
+            rxs.push_back(&receiver);
+        for (auto &sender : client.senders)
+            if (sender.rx)
+                rxs.push_back(sender.rx.get());
+
+        size_t receive_count = 0;
+        for (auto receiver : rxs) {
+            std::cout << "Received messages on core " << receiver->core << ": "
+                << receiver->metrics->receive_count << '\n';
+            receive_count += receiver->metrics->receive_count;
+        }
+        std::cout << "Received messages: " << receive_count << '\n';
+        for (auto receiver : rxs)
+            if (receiver->recorder)
+                std::cout << "Recorded bytes on core " << receiver->core << ": "
+                    << receiver->recorder->end << ", dropped PDUs: "
+                    << receiver->recorder->dropped << '\n';
+        if (client.receiver_cfg.correlation.size)
+            print_latencies(std::cout, rxs);
+        if (client.receiver_cfg.timestamping)
+            print_kernel_stamps(std::cout, rxs);
         for (auto &sender : client.senders) {
             std::cout << "Sent messages on core " << sender.core << ": "
-                << sender.send_count << '\n'
+                << sender.metrics->send_count << '\n'
                 << "Missed timer events on core " << sender.core << ": "
-                << sender.timer_was_late << '\n';
+                << sender.metrics->timer_was_late << '\n'
+                << "Dropped messages on core " << sender.core << ": "
+                << sender.metrics->dropped_count << '\n';
+        }
+        if (!client.sender_cfg.blocking_writes && !client.sender_cfg.flood) {
+            print_backpressure(std::cout, client.senders);
+            print_sender_hists(std::cout, client.senders, "Outbound queueing delay (ns)",
+                    [](const Sender &s) -> const Histogram & { return s.queue_delay_hist; });
         }
+        print_io(std::cout, client.senders, rxs,
+                client.sender_cfg.io_uring ? "io_uring" : "epoll");
+        if (client.sender_cfg.flood)
+            print_flood(std::cout, client.senders);
+        if (!client.sender_cfg.windows.empty())
+            print_windows(std::cout, client.senders, rxs, client.sender_cfg.windows);
+        if (uint64_t ns = client.sender_cfg.profile.report_interval_ns)
+            print_rates(std::cout, client.senders, ns);
+        print_sender_hists(std::cout, client.senders, "Connect latency (ns)",
+                [](const Sender &s) -> const Histogram & { return s.connect_hist; });
+        print_sender_hists(std::cout, client.senders, "Login latency (ns)",
+                [](const Sender &s) -> const Histogram & { return s.login_hist; });
+        print_sender_hists(std::cout, client.senders, "Timer wake-up delay (ns)",
+                [](const Sender &s) -> const Histogram & { return s.wakeup_hist; });
+        print_sender_hists(std::cout, client.senders, "Deadline to write completion (ns)",
+                [](const Sender &s) -> const Histogram & { return s.completion_hist; });
+        print_sender_hists(std::cout, client.senders, "Write latency (ns)",
+                [](const Sender &s) -> const Histogram & { return s.metrics->write_hist; });
+        print_sender_hists(std::cout, client.senders, "Send time error (ns)",
+                [](const Sender &s) -> const Histogram & { return s.metrics->send_error_hist; });
 
         return !success;
 
@@ -0,0 +1,100 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "metrics.hh"
+#include "correlation.hh" // stamp_now_ns
+
+#include <ixxx/posix.hh>
+
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>     // getpid
+
+
+static uint64_t align64(uint64_t x)
+{
+    return (x + 63) / 64 * 64;
+}
+
+void Metrics_Header::check(size_t mapped_size) const
+{
+    if (mapped_size < sizeof *this || memcmp(magic, METRICS_MAGIC, sizeof magic))
+        throw std::runtime_error("not a tcploadgen metrics segment");
+    if (version != METRICS_VERSION || header_size != sizeof *this
+            || sender_size != sizeof(Sender_Metrics)
+            || receiver_size != sizeof(Receiver_Metrics)
+            || session_size != sizeof(Session_Metrics)
+            || hist_buckets != Histogram::BUCKETS) {
+        std::ostringstream o;
+        o << "incompatible metrics segment version: " << version
+            << " (expected: " << METRICS_VERSION << ')';
+        throw std::runtime_error(o.str());
+    }
+    if (size > mapped_size)
+        throw std::runtime_error("truncated metrics segment");
+}
+
+void Metrics_Segment::create(const std::string &filename, unsigned no_senders,
+        unsigned no_receivers, unsigned no_sessions)
+{
+    Metrics_Header h = {};
+    h.version = METRICS_VERSION;
+    h.header_size = sizeof h;
+    h.sender_size = sizeof(Sender_Metrics);
+    h.receiver_size = sizeof(Receiver_Metrics);
+    h.session_size = sizeof(Session_Metrics);
+    h.hist_buckets = Histogram::BUCKETS;
+    h.no_senders = no_senders;
+    h.no_receivers = no_receivers;
+    h.no_sessions = no_sessions;
+    h.senders_off = align64(sizeof h);
+    h.receivers_off = align64(h.senders_off + no_senders * sizeof(Sender_Metrics));
+    h.sessions_off = align64(h.receivers_off + no_receivers * sizeof(Receiver_Metrics));
+    h.session_received_off = align64(h.sessions_off + no_sessions * sizeof(Session_Metrics));
+    h.size = h.session_received_off + no_sessions * sizeof(Counter<uint64_t>);
+    h.start_ns = stamp_now_ns();
+    h.pid = getpid();
+
+    void *p = nullptr;
+    if (filename.empty()) {
+        p = ixxx::posix::mmap(nullptr, h.size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        int fd = ixxx::posix::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        try {
+            ixxx::posix::ftruncate(fd, h.size);
+            p = ixxx::posix::mmap(nullptr, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        ixxx::posix::close(fd);
+    }
+    size = h.size;
+    header = new (p) Metrics_Header(h);
+
+    for (unsigned i = 0; i < no_senders; ++i)
+        new (header->senders() + i) Sender_Metrics();
+    for (unsigned i = 0; i < no_receivers; ++i)
+        new (header->receivers() + i) Receiver_Metrics();
+    for (unsigned i = 0; i < no_sessions; ++i) {
+        new (header->sessions() + i) Session_Metrics();
+        new (header->session_received() + i) Counter<uint64_t>();
+    }
+
+    // readers don't see a valid segment before it's initialized
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, METRICS_MAGIC, sizeof METRICS_MAGIC);
+}
+
+Metrics_Segment::~Metrics_Segment()
+{
+    // the file is kept, thus, the final values can still be read
+    if (header)
+        munmap(header, size);
+}
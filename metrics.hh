@@ -0,0 +1,127 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include "counter.hh"
+#include "histogram.hh"
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of the metrics segment, i.e. the sender and receiver threads
+// record their counters and histograms directly into it, and external
+// tools may map it read-only (cf. metrics_reader.cc).
+//
+//     Metrics_Header
+//     Sender_Metrics   [no_senders]
+//     Receiver_Metrics [no_receivers]
+//     Session_Metrics  [no_sessions]    (written by the sender threads)
+//     Counter<uint64_t>[no_sessions]    (responses, written by the receivers)
+//
+// Each record has a single writer. Readers sample the counters with
+// relaxed loads and the histograms with Log_Histogram::snapshot().
+// Any layout change has to bump METRICS_VERSION.
+
+static constexpr char METRICS_MAGIC[8] = { 'T', 'L', 'G', 'M', 'E', 'T', 'R', 'C' };
+static constexpr uint32_t METRICS_VERSION = 2;
+
+struct alignas(64) Sender_Metrics {
+    uint32_t core {0};
+
+    Counter<uint64_t> send_count;
+    Counter<uint64_t> timer_was_late;
+    // ticks skipped after late timer wakeups (unless catch_up)
+    Counter<uint64_t> dropped_count;
+
+    // duration of the main flow write calls
+    Histogram write_hist;
+    // intended send time -> start of the write call
+    Histogram send_error_hist;
+};
+
+struct alignas(64) Receiver_Metrics {
+    uint32_t core {0};
+
+    Counter<uint64_t> receive_count;
+    Counter<uint64_t> unmatched_count;
+
+    // round-trip times of all connections
+    Histogram rtt_hist;
+};
+
+struct Session_Metrics {
+    uint32_t session_id {0};
+    // of the sender thread
+    uint32_t core {0};
+    Counter<uint64_t> send_count;
+
+    // backpressure, i.e. writes that hit a full socket buffer,
+    // the current outbound queue size and messages skipped
+    // because the queue was full
+    Counter<uint64_t> eagain_count;
+    Counter<uint64_t> queued_bytes;
+    Counter<uint64_t> backpressure_drops;
+};
+
+struct Metrics_Header {
+    char magic[8];
+    uint32_t version;
+    // for detecting a mismatching histogram/record layout
+    uint32_t header_size;
+    uint32_t sender_size;
+    uint32_t receiver_size;
+    uint32_t session_size;
+    uint32_t hist_buckets;
+
+    uint32_t no_senders;
+    uint32_t no_receivers;
+    uint32_t no_sessions;
+    uint32_t reserved;
+
+    uint64_t senders_off;
+    uint64_t receivers_off;
+    uint64_t sessions_off;
+    uint64_t session_received_off;
+    uint64_t size;
+
+    // CLOCK_REALTIME
+    uint64_t start_ns;
+    uint64_t pid;
+
+    template <typename T>
+    T *at(uint64_t off) const
+    {
+        return reinterpret_cast<T*>(reinterpret_cast<char*>(
+                    const_cast<Metrics_Header*>(this)) + off);
+    }
+    Sender_Metrics *senders() const { return at<Sender_Metrics>(senders_off); }
+    Receiver_Metrics *receivers() const { return at<Receiver_Metrics>(receivers_off); }
+    Session_Metrics *sessions() const { return at<Session_Metrics>(sessions_off); }
+    Counter<uint64_t> *session_received() const
+    {
+        return at<Counter<uint64_t>>(session_received_off);
+    }
+
+    // throws if the segment was written by an incompatible version
+    void check(size_t mapped_size) const;
+};
+
+// owns the mapping, i.e. a shared file (e.g. under /dev/shm)
+// or anonymous memory if no filename is configured
+struct Metrics_Segment {
+    Metrics_Segment() = default;
+    Metrics_Segment(const Metrics_Segment &) = delete;
+    Metrics_Segment &operator=(const Metrics_Segment &) = delete;
+    ~Metrics_Segment();
+
+    Metrics_Header *header {nullptr};
+    size_t size {0};
+
+    void create(const std::string &filename, unsigned no_senders,
+            unsigned no_receivers, unsigned no_sessions);
+};
+
+#endif
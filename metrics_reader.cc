@@ -0,0 +1,177 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Companion tool for the tcploadgen metrics segment (cf. metrics.file):
+// takes two snapshots of a running (or finished) generator and prints
+// the rates and latency percentiles of the interval in between.
+//
+// Usage: tcploadgen_metrics [-i MILLISECONDS] [-s] FILENAME
+
+#include "metrics.hh"
+
+#include <ixxx/posix.hh>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>     // getopt
+
+
+namespace {
+
+struct Snapshot {
+    uint64_t ns {0};
+    std::vector<uint64_t> sent;
+    std::vector<uint64_t> late;
+    std::vector<uint64_t> dropped;
+    std::vector<uint64_t> received;
+    std::vector<uint64_t> unmatched;
+    std::vector<uint64_t> session_sent;
+    std::vector<uint64_t> session_received;
+    std::vector<uint64_t> session_eagain;
+    std::vector<uint64_t> session_drops;
+    std::unique_ptr<Histogram> send_error {std::make_unique<Histogram>()};
+    std::unique_ptr<Histogram> rtt {std::make_unique<Histogram>()};
+
+    void take(const Metrics_Header &h);
+};
+
+}
+
+void Snapshot::take(const Metrics_Header &h)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = uint64_t(ts.tv_sec) * 1000000000ul + ts.tv_nsec;
+
+    auto tmp = std::make_unique<Histogram>();
+    for (uint32_t i = 0; i < h.no_senders; ++i) {
+        const Sender_Metrics &m = h.senders()[i];
+        sent.push_back(m.send_count);
+        late.push_back(m.timer_was_late);
+        dropped.push_back(m.dropped_count);
+        tmp->snapshot(m.send_error_hist);
+        send_error->merge(*tmp);
+    }
+    for (uint32_t i = 0; i < h.no_receivers; ++i) {
+        const Receiver_Metrics &m = h.receivers()[i];
+        received.push_back(m.receive_count);
+        unmatched.push_back(m.unmatched_count);
+        tmp->snapshot(m.rtt_hist);
+        rtt->merge(*tmp);
+    }
+    for (uint32_t i = 0; i < h.no_sessions; ++i) {
+        session_sent.push_back(h.sessions()[i].send_count);
+        session_received.push_back(h.session_received()[i]);
+        session_eagain.push_back(h.sessions()[i].eagain_count);
+        session_drops.push_back(h.sessions()[i].backpressure_drops);
+    }
+}
+
+static void print_percentiles(std::ostream &o, const char *name, Histogram &a, const Histogram &b)
+{
+    a.subtract(b);
+    o << name << ": n=" << a.count;
+    if (a.count)
+        for (double q : { 50.0, 90.0, 99.0, 99.9 })
+            o << " p" << q << '=' << a.percentile(q);
+    o << '\n';
+}
+
+static void help(std::ostream &o, const char *argv0)
+{
+    o << argv0 << " - print rates from a tcploadgen metrics segment\n"
+        << "Usage: " << argv0 << " [-i MILLISECONDS] [-s] FILENAME\n"
+        << "\n"
+        << "Options:\n"
+        << "  -i MS   interval between the two snapshots (default: 1000)\n"
+        << "  -s      also print the per-session rates\n"
+        << "  -h      display this help\n";
+}
+
+int main(int argc, char **argv)
+{
+    try {
+        unsigned interval_ms = 1000;
+        bool per_session = false;
+        int c;
+        while ((c = getopt(argc, argv, "hi:s")) != -1) {
+            switch (c) {
+                case 'h':
+                    help(std::cout, argv[0]);
+                    return 0;
+                case 'i':
+                    interval_ms = atoi(optarg);
+                    break;
+                case 's':
+                    per_session = true;
+                    break;
+                default:
+                    help(std::cerr, argv[0]);
+                    return 2;
+            }
+        }
+        if (optind + 1 != argc) {
+            help(std::cerr, argv[0]);
+            return 2;
+        }
+
+        int fd = ixxx::posix::open(argv[optind], O_RDONLY);
+        struct stat st;
+        ixxx::posix::fstat(fd, &st);
+        void *p = ixxx::posix::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ixxx::posix::close(fd);
+        const Metrics_Header &h = *static_cast<const Metrics_Header*>(p);
+        h.check(st.st_size);
+
+        Snapshot a, b;
+        a.take(h);
+        struct timespec ts = { .tv_sec = time_t(interval_ms / 1000),
+            .tv_nsec = long(interval_ms % 1000) * 1000000 };
+        nanosleep(&ts, nullptr);
+        b.take(h);
+
+        double s = (b.ns - a.ns) / 1e9;
+        std::cout << "pid " << h.pid << ", interval " << s << " s\n";
+        uint64_t sent = 0, received = 0;
+        for (uint32_t i = 0; i < h.no_senders; ++i) {
+            sent += b.sent[i] - a.sent[i];
+            std::cout << "Sender on core " << h.senders()[i].core << ": "
+                << (b.sent[i] - a.sent[i]) / s << " msg/s, late timers: "
+                << b.late[i] - a.late[i] << ", dropped: "
+                << b.dropped[i] - a.dropped[i] << " (total sent: " << b.sent[i] << ")\n";
+        }
+        for (uint32_t i = 0; i < h.no_receivers; ++i) {
+            received += b.received[i] - a.received[i];
+            std::cout << "Receiver on core " << h.receivers()[i].core << ": "
+                << (b.received[i] - a.received[i]) / s << " msg/s, unmatched: "
+                << b.unmatched[i] - a.unmatched[i]
+                << " (total received: " << b.received[i] << ")\n";
+        }
+        std::cout << "All: sent " << sent / s << " msg/s, received "
+            << received / s << " msg/s\n";
+        print_percentiles(std::cout, "Send time error (ns)", *b.send_error, *a.send_error);
+        print_percentiles(std::cout, "Round-trip latency (ns)", *b.rtt, *a.rtt);
+
+        if (per_session) {
+            for (uint32_t i = 0; i < h.no_sessions; ++i)
+                std::cout << "Session " << h.sessions()[i].session_id << " (core "
+                    << h.sessions()[i].core << "): sent "
+                    << (b.session_sent[i] - a.session_sent[i]) / s << " msg/s, received "
+                    << (b.session_received[i] - a.session_received[i]) / s << " msg/s, eagain "
+                    << b.session_eagain[i] - a.session_eagain[i] << ", queued "
+                    << h.sessions()[i].queued_bytes << " bytes, dropped "
+                    << b.session_drops[i] - a.session_drops[i] << '\n';
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
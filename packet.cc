@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "packet.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <assert.h>
+#include <string.h> // memcpy
+
+
+static std::unordered_map<std::string_view, Operator> str2op_map = {
+    { "inc", Operator::INCREMENT },
+    { "stamp", Operator::STAMP }
+};
+Operator str2operator(const std::string_view &s)
+{
+    return str2op_map[s];
+}
+
+Stamp_Clock str2clock(const std::string_view &s)
+{
+    if (s == "realtime")
+        return Stamp_Clock::REALTIME;
+    if (s == "tai")
+        return Stamp_Clock::TAI;
+    if (s == "sched")
+        return Stamp_Clock::SCHED;
+    throw std::runtime_error("unknown clock: " + std::string(s));
+}
+
+
+static void increment_uint(unsigned char *v, unsigned size)
+{
+    switch (size) {
+        case 1:
+            ++*v;
+            break;
+        case 2:
+            {
+                uint16_t i;
+                memcpy(&i, v, size);
+                ++i;
+                memcpy(v, &i, size);
+            }
+            break;
+        case 4:
+            {
+                uint32_t i;
+                memcpy(&i, v, size);
+                ++i;
+                memcpy(v, &i, size);
+            }
+            break;
+        case 8:
+            {
+                uint64_t i;
+                memcpy(&i, v, size);
+                ++i;
+                memcpy(v, &i, size);
+            }
+            break;
+    }
+}
+
+
+void Packet::apply_variables(const Var_Decls &decls, const Vars &global, unsigned char *local)
+{
+    for (unsigned i = 0; i < sizeof vars / sizeof vars[0]; ++i) {
+        if (!vars[i])
+            break;
+
+        unsigned k = vars[i] - 1;
+        unsigned n = sizeof global.v / sizeof global.v[0];
+        assert(k < 2*n);
+
+        const unsigned char *t;
+        if (k < n)
+            t = global.v[k];
+        else
+            t = local + decls.local_offs[k];
+        memcpy(payload.data() + decls.offs[k], t, decls.sizes[k]);
+
+
+    }
+    for (unsigned i = 0; i < sizeof actions / sizeof actions[0]; ++i) {
+        if (!actions[i][0])
+            break;
+
+        Operator a = Operator(actions[i][0] - 1);
+        unsigned k = actions[i][1] - 1;
+        unsigned n = sizeof global.v / sizeof global.v[0];
+        assert(k < 2*n);
+
+        if (k < n)
+            throw std::runtime_error("cannot modify globals");
+        unsigned char *t = local + decls.local_offs[k];
+
+        switch (a) {
+            case Operator::INCREMENT:
+                increment_uint(t, decls.sizes[k]);
+                break;
+            case Operator::STAMP:
+                // applied by the sender
+                break;
+            default:
+                throw std::runtime_error("unknown operator");
+        }
+    }
+}
+
+
+template <unsigned N>
+static void copy_var(unsigned char *dst, unsigned char *var, unsigned)
+{
+    memcpy(dst, var, N);
+}
+static void copy_var_n(unsigned char *dst, unsigned char *var, unsigned size)
+{
+    memcpy(dst, var, size);
+}
+
+template <typename T>
+static void increment_var(unsigned char *, unsigned char *var, unsigned)
+{
+    T i;
+    memcpy(&i, var, sizeof i);
+    ++i;
+    memcpy(var, &i, sizeof i);
+}
+
+static void nop_var(unsigned char *, unsigned char *, unsigned)
+{
+}
+
+typedef void (*Patch_Fn)(unsigned char *dst, unsigned char *var, unsigned size);
+
+static Patch_Fn copy_kernel(unsigned size)
+{
+    switch (size) {
+        case 1: return copy_var<1>;
+        case 2: return copy_var<2>;
+        case 4: return copy_var<4>;
+        case 8: return copy_var<8>;
+        case 16: return copy_var<16>;
+        case 32: return copy_var<32>;
+        default: return copy_var_n;
+    }
+}
+
+static Patch_Fn increment_kernel(unsigned size)
+{
+    switch (size) {
+        case 1: return increment_var<uint8_t>;
+        case 2: return increment_var<uint16_t>;
+        case 4: return increment_var<uint32_t>;
+        case 8: return increment_var<uint64_t>;
+        // cf. increment_uint()
+        default: return nop_var;
+    }
+}
+
+void Packet::compile(const Var_Decls &decls, const Vars &global)
+{
+    unsigned n = sizeof global.v / sizeof global.v[0];
+    no_ops = 0;
+    unsigned begin = payload.size();
+    unsigned end = 0;
+    no_stamps = 0;
+    for (unsigned i = 0; i < sizeof actions / sizeof actions[0]; ++i) {
+        if (!actions[i][0])
+            break;
+        if (Operator(actions[i][0] - 1) != Operator::STAMP)
+            continue;
+
+        unsigned k = actions[i][1] - 1;
+        if (decls.clocks[k] == Stamp_Clock::NONE)
+            throw std::runtime_error("stamp operator on a variable without clock");
+        if (decls.sizes[k] != 4 && decls.sizes[k] != 8)
+            throw std::runtime_error("stamp variable size must be 4 or 8");
+        if (decls.offs[k] + decls.sizes[k] > payload.size())
+            throw std::runtime_error("variable exceeds packet payload");
+        if (no_stamps == sizeof stamps / sizeof stamps[0])
+            throw std::runtime_error("too many stamp operators in packet");
+        Stamp_Op &st = stamps[no_stamps++];
+        st.off = decls.offs[k];
+        st.size = decls.sizes[k];
+        st.clock = decls.clocks[k];
+
+        begin = std::min(begin, decls.offs[k]);
+        end = std::max(end, decls.offs[k] + decls.sizes[k]);
+    }
+    for (unsigned i = 0; i < sizeof vars / sizeof vars[0]; ++i) {
+        if (!vars[i])
+            break;
+
+        unsigned k = vars[i] - 1;
+        assert(k < 2*n);
+        if (decls.offs[k] + decls.sizes[k] > payload.size())
+            throw std::runtime_error("variable exceeds packet payload");
+
+        if (k < n) {
+            // globals never change
+            memcpy(payload.data() + decls.offs[k], global.v[k], decls.sizes[k]);
+            continue;
+        }
+        Patch_Op &op = ops[no_ops++];
+        op.fn = copy_kernel(decls.sizes[k]);
+        op.off = decls.offs[k];
+        op.var = decls.local_offs[k];
+        op.size = decls.sizes[k];
+
+        begin = std::min(begin, decls.offs[k]);
+        end = std::max(end, decls.offs[k] + decls.sizes[k]);
+    }
+    if (begin < end) {
+        patch_off = begin;
+        patch_len = end - begin;
+    } else {
+        patch_off = 0;
+        patch_len = 0;
+    }
+    std::vector<bool> covered(patch_len);
+    for (unsigned i = 0; i < no_ops; ++i) {
+        ops[i].off -= patch_off;
+        std::fill_n(covered.begin() + ops[i].off, ops[i].size, true);
+    }
+    for (unsigned i = 0; i < no_stamps; ++i) {
+        stamps[i].off -= patch_off;
+        std::fill_n(covered.begin() + stamps[i].off, stamps[i].size, true);
+    }
+    patch_gaps = std::find(covered.begin(), covered.end(), false) != covered.end();
+
+    for (unsigned i = 0; i < sizeof actions / sizeof actions[0]; ++i) {
+        if (!actions[i][0])
+            break;
+
+        Operator a = Operator(actions[i][0] - 1);
+        unsigned k = actions[i][1] - 1;
+        assert(k < 2*n);
+        if (k < n)
+            throw std::runtime_error("cannot modify globals");
+
+        if (a == Operator::STAMP)
+            continue;
+
+        Patch_Op &op = ops[no_ops++];
+        switch (a) {
+            case Operator::INCREMENT:
+                op.fn = increment_kernel(decls.sizes[k]);
+                break;
+            default:
+                throw std::runtime_error("unknown operator");
+        }
+        op.off = 0;
+        op.var = decls.local_offs[k];
+        op.size = decls.sizes[k];
+    }
+}
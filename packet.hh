@@ -0,0 +1,141 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PACKET_HH
+#define PACKET_HH
+
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include <string.h> // memcpy
+
+// source of a send timestamp variable, i.e. the value is written
+// right before the packet is sent
+enum class Stamp_Clock : unsigned char {
+    NONE,
+    REALTIME,
+    TAI,
+    // the intended send time
+    SCHED
+};
+
+Stamp_Clock str2clock(const std::string_view &s);
+
+// ids 0..7 are global, 8..15 local variables
+struct Var_Decls {
+    unsigned char sizes[16] {0};
+    unsigned offs[16] {0};
+    Stamp_Clock clocks[16] {};
+
+    // offset of each local variable in the variable bytes of a session,
+    // i.e. they are packed without padding, cf. layout()
+    unsigned short local_offs[16] {0};
+    // variable bytes per session
+    unsigned local_size {0};
+
+    // after all sizes are declared
+    void layout()
+    {
+        local_size = 0;
+        for (unsigned i = 8; i < 16; ++i) {
+            local_offs[i] = local_size;
+            local_size += sizes[i];
+        }
+    }
+};
+
+// the global variables, i.e. the local ones are stored as
+// Var_Decls::local_size bytes per session
+struct Vars {
+    unsigned char v[8][32] {0};
+
+};
+
+
+enum class Operator {
+    INCREMENT,
+    // writes the current time of the variable's clock, cf. Stamp_Clock
+    STAMP
+};
+
+Operator str2operator(const std::string_view &s);
+
+// one step of a compiled packet patch program, i.e. fn is a copy or
+// operator kernel that is specialized for the variable size
+struct Patch_Op {
+    void (*fn)(unsigned char *dst, unsigned char *var, unsigned size);
+    // unsigned since packets aren't limited in size
+    unsigned off;
+    // index into Var_Decls::local_offs of the local variable
+    unsigned short var;
+    unsigned char size;
+};
+
+// a send timestamp field in the patch region
+struct Stamp_Op {
+    unsigned off;
+    unsigned char size;
+    Stamp_Clock clock;
+};
+
+// A packet template, i.e. it's immutable after compile() and shared
+// by all sender threads. Only the patch region is rendered for each
+// send, into a separate buffer.
+struct Packet {
+    std::vector<unsigned char> payload;
+    unsigned answer_tag {0};
+    unsigned char vars[8] {0};
+    // array of { operator, variable } pairs
+    unsigned char actions[8][2] {{0}};
+
+    // part of the payload that covers all local variables
+    unsigned patch_off {0};
+    unsigned patch_len {0};
+    // the patch region has gaps between the variables that need
+    // to be filled from the template
+    bool patch_gaps {false};
+
+    // compiled from vars and actions, offsets are relative to patch_off
+    Patch_Op ops[16];
+    unsigned char no_ops {0};
+    Stamp_Op stamps[4];
+    unsigned char no_stamps {0};
+
+    // interprets vars and actions, i.e. modifies the payload in place
+    void apply_variables(const Var_Decls &decls, const Vars &global_vars, unsigned char *vars);
+
+    // pre-applies the global variables and translates the local variables
+    // and actions into ops
+    void compile(const Var_Decls &decls, const Vars &global_vars);
+
+    // renders the patch region for the next send into buf
+    // (of at least patch_len bytes), after compile()
+    // vars: the variable bytes of the session
+    void render(unsigned char *vars, unsigned char *buf) const
+    {
+        if (patch_gaps)
+            memcpy(buf, payload.data() + patch_off, patch_len);
+        for (unsigned i = 0; i < no_ops; ++i) {
+            const Patch_Op &op = ops[i];
+            op.fn(buf + op.off, vars + op.var, op.size);
+        }
+    }
+
+    // writes the send timestamps into the rendered patch region,
+    // ns is indexed by Stamp_Clock
+    void stamp(unsigned char *buf, const uint64_t *ns) const
+    {
+        for (unsigned i = 0; i < no_stamps; ++i) {
+            const Stamp_Op &st = stamps[i];
+            uint64_t x = ns[unsigned(st.clock)];
+            if (st.size == 8) {
+                memcpy(buf + st.off, &x, 8);
+            } else {
+                uint32_t y = x;
+                memcpy(buf + st.off, &y, 4);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PROFILE_HH
+#define PROFILE_HH
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+
+// modulates the send rate of the sessions over the run time,
+// i.e. the rate factor scales the session's base rate (1/interval_ns)
+struct Load_Profile {
+    enum class Shape { CONSTANT, RAMP, STEP, SINE };
+    enum class Arrivals { FIXED, POISSON };
+
+    Shape shape {Shape::CONSTANT};
+    Arrivals arrivals {Arrivals::FIXED};
+
+    // RAMP: linear from -> to during duration_ns, then constant
+    double from {1};
+    double to {1};
+    uint64_t duration_ns {0};
+
+    // STEP: steps[i] during [i * step_ns, (i+1) * step_ns),
+    // the last one until the end
+    std::vector<double> steps;
+    uint64_t step_ns {0};
+
+    // SINE: 1 + amplitude * sin(2 pi t / period_ns)
+    double amplitude {0};
+    uint64_t period_ns {0};
+
+    // seeds the per-session generators of the Poisson arrivals
+    uint64_t seed {0};
+
+    // offered vs. achieved rate reporting, 0 disables it
+    uint64_t report_interval_ns {0};
+
+    // t_ns: relative to the start of the run
+    double rate(uint64_t t_ns) const
+    {
+        switch (shape) {
+            case Shape::CONSTANT:
+                break;
+            case Shape::RAMP:
+                if (t_ns >= duration_ns)
+                    return to;
+                return from + (to - from) * double(t_ns) / double(duration_ns);
+            case Shape::STEP:
+                return steps[std::min<uint64_t>(t_ns / step_ns, steps.size() - 1)];
+            case Shape::SINE:
+                return 1 + amplitude * sin(2 * M_PI * double(t_ns) / double(period_ns));
+        }
+        return 1;
+    }
+
+    // returns the distance to the next intended send time of a session,
+    // rng is the session's generator state
+    uint64_t next_interval(uint64_t interval_ns, uint64_t t_ns, uint64_t &rng) const
+    {
+        if (shape == Shape::CONSTANT && arrivals == Arrivals::FIXED)
+            return interval_ns;
+        double d = double(interval_ns) / rate(t_ns);
+        if (arrivals == Arrivals::POISSON) {
+            // exponentially distributed inter-arrival times,
+            // u is uniform in (0, 1]
+            double u = double((splitmix64(rng) >> 11) + 1) * 0x1.0p-53;
+            d *= -log(u);
+        }
+        return std::max<uint64_t>(1, d);
+    }
+
+    static uint64_t splitmix64(uint64_t &x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ul);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+        return z ^ (z >> 31);
+    }
+};
+
+// counts messages per reporting interval, relative to the start of the run
+struct Rate_Log {
+    uint64_t start_ns {0};
+    uint64_t interval_ns {0};
+    std::vector<uint32_t> counts;
+
+    void record(uint64_t t_ns)
+    {
+        if (!interval_ns || t_ns < start_ns)
+            return;
+        size_t i = (t_ns - start_ns) / interval_ns;
+        if (i >= counts.size())
+            counts.resize(i + 1);
+        ++counts[i];
+    }
+};
+
+#endif
@@ -11,11 +11,19 @@
 #include <ixxx/util.hh>
 #include <ixxx/pthread_util.hh>
 
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 #include <string.h>
+#include <errno.h>
 
+#include <linux/errqueue.h>   // sock_extended_err, scm_timestamping
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>         // IPPROTO_IP
 #include <sys/epoll.h>
+#include <sys/socket.h> // recvmsg
+#include <unistd.h>     // write
 
 
 uint64_t Field::read_uint(const unsigned char *b, size_t l) const
@@ -64,100 +72,337 @@ static std::string read_msg(const unsigned char *buf, size_t l,
     return r;
 }
 
-unsigned Receiver_Config::receive_next(int fd, unsigned char *buf, size_t buf_size) const
+unsigned Receiver_Config::check_pdu(const unsigned char *b, size_t l) const
 {
-    ssize_t n = ixxx::util::read_all(fd, buf, len.off + len.size);
-    if (!n) {
-        throw std::underflow_error("early EOF on one conections");
+    unsigned t = tag.read_uint(b, l);
+    if (t == error_tag) {
+        std::string msg = read_msg(b, l, error_msg_off,
+                error_msg_len.read_uint(b, l));
+        throw std::runtime_error("Received error: " + msg);
     }
-    if (n != len.off + len.size) {
-        throw std::runtime_error("short read on one conections");
+    return t;
+}
+
+
+void Receiver::correlate(Connection &c, const unsigned char *buf, size_t n)
+{
+    uint64_t key = cfg.correlation.read_uint(buf, n);
+    uint64_t ts = 0;
+    if (!c.stamps || !c.stamps->get(key, ts)) {
+        ++metrics->unmatched_count;
+        return;
     }
-    unsigned l = len.read_uint(buf, n);
-    if (l + len.off + len.size > buf_size) {
-        throw std::runtime_error("message too long");
+    uint64_t rtt = stamp_now_ns() - ts;
+    if (c.rtts)
+        c.rtts->record(rtt);
+    metrics->rtt_hist.record(rtt);
+}
+
+// releases the credit of the oldest outstanding request,
+// returns false for an unsolicited response
+bool Receiver::complete(Credit_Window &w)
+{
+    uint64_t i = w.completed.load(std::memory_order_relaxed);
+    if (i == w.sent.load(std::memory_order_acquire))
+        return false;
+    uint64_t rtt = stamp_now_ns() - w.ts[i % Credit_Window::MAX];
+    window_hists[w.phase[i % Credit_Window::MAX]].record(rtt);
+    w.completed.store(i + 1, std::memory_order_release);
+    return true;
+}
+
+bool Tx_State::match(uint64_t &next, uint32_t id, uint64_t &ts)
+{
+    for (unsigned k = 0; k < Stamp_Table::SLOTS; ++k) {
+        uint64_t key;
+        if (!writes->get_at(next % Stamp_Table::SLOTS, key, ts))
+            return false;
+        uint32_t idx = key >> 32;
+        uint32_t end = key;
+        if (idx != uint32_t(next)) {
+            if (int32_t(idx - uint32_t(next)) < 0)
+                return false;
+            // we fell behind by more than the table size
+            next += uint32_t(idx - uint32_t(next));
+            continue;
+        }
+        if (end == id) {
+            ++next;
+            return true;
+        }
+        // the stamp of a partial write
+        if (int32_t(end - id) > 0)
+            return false;
+        // the stamp of this write got lost
+        ++next;
     }
-    if (l <= len.off + len.size) {
-        throw std::runtime_error("message too short");
+    return false;
+}
+
+static uint64_t ts2ns(const struct timespec &ts)
+{
+    return uint64_t(ts.tv_sec) * 1000000000ul + ts.tv_nsec;
+}
+
+// returns 0 if there is no software timestamp
+static uint64_t kernel_stamp(struct msghdr &msg)
+{
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cm), sizeof tss);
+            return ts2ns(tss.ts[0]);
+        }
     }
-    size_t x = l - len.off - len.size;
-    n = ixxx::util::read_all(fd, buf + len.off + len.size, x);
-    if (n != ssize_t(x)) {
-        throw std::runtime_error("couldn't read complete message");
+    return 0;
+}
+
+// reads the TX timestamps (SO_TIMESTAMPING) of the session's writes
+void Receiver::read_errqueue(int fd, Connection &c)
+{
+    Tx_State &t = *c.tx;
+    for (;;) {
+        char ctrl[512];
+        struct msghdr msg = {};
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+        ++syscalls;
+        ssize_t r = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            std::ostringstream o;
+            o << "Receiver: reading error queue failed on conn_fd " << fd << " (" << errno << ')';
+            throw std::runtime_error(o.str());
+        }
+        uint64_t kernel_ns = kernel_stamp(msg);
+        struct sock_extended_err ee = {};
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if ((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR)
+                    || (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                memcpy(&ee, CMSG_DATA(cm), sizeof ee);
+        }
+        if (!kernel_ns || ee.ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+
+        uint64_t user_ns = 0;
+        if (ee.ee_info == SCM_TSTAMP_SND) {
+            if (!t.match(t.snd_next, ee.ee_data, user_ns))
+                continue;
+            uint64_t i = t.snd_next - 1;
+            tx_kernel_hist.record(kernel_ns > user_ns ? kernel_ns - user_ns : 0);
+            t.kernel_tx[i % Stamp_Table::SLOTS] = kernel_ns;
+            t.kernel_tx_idx[i % Stamp_Table::SLOTS] = i;
+        } else if (ee.ee_info == SCM_TSTAMP_ACK) {
+            if (!t.match(t.ack_next, ee.ee_data, user_ns))
+                continue;
+            uint64_t i = t.ack_next - 1;
+            if (t.kernel_tx_idx[i % Stamp_Table::SLOTS] == i) {
+                uint64_t tx_ns = t.kernel_tx[i % Stamp_Table::SLOTS];
+                tx_ack_hist.record(kernel_ns > tx_ns ? kernel_ns - tx_ns : 0);
+            }
+        }
     }
-    unsigned t = tag.read_uint(buf, l);
-    if (t == error_tag) {
-        std::string msg = read_msg(buf, l, error_msg_off,
-                error_msg_len.read_uint(buf, l));
-        throw std::runtime_error("Received error: " + msg);
+}
+
+// pairs the response with the kernel TX stamp of its request
+void Receiver::record_rx(Tx_State &t, uint64_t rx_ns)
+{
+    uint64_t i = t.responses++;
+    if (!rx_ns || t.kernel_tx_idx[i % Stamp_Table::SLOTS] != i)
+        return;
+    uint64_t tx_ns = t.kernel_tx[i % Stamp_Table::SLOTS];
+    wire_rtt_hist.record(rx_ns > tx_ns ? rx_ns - tx_ns : 0);
+}
+
+// reads as much as is available and processes all complete PDUs,
+// returns false on EOF
+bool Receiver::receive(int fd, Connection &c)
+{
+    size_t n = c.partial.size();
+    if (n)
+        memcpy(rx_buf, c.partial.data(), n);
+    if (c.tx) {
+        // the TX stamps of the requests before their responses
+        read_errqueue(fd, c);
+    }
+    struct iovec iov = { rx_buf + n, sizeof rx_buf - n };
+    char ctrl[256];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (c.tx) {
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+    }
+    ++syscalls;
+    ssize_t r = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return true;
+        std::ostringstream o;
+        o << "Receiver: recv failed on conn_fd " << fd << " (" << errno << ')';
+        throw std::runtime_error(o.str());
+    }
+    if (!r)
+        return false;
+    // the stamp of the last segment, for all PDUs of this read
+    process(c, n + r, c.tx ? kernel_stamp(msg) : 0);
+    return true;
+}
+
+// consumes the data of a multishot recv, in chunks that fit into rx_buf
+// after the partial PDU
+void Receiver::consume(Connection &c, const unsigned char *b, size_t n)
+{
+    while (n) {
+        size_t m = c.partial.size();
+        if (m)
+            memcpy(rx_buf, c.partial.data(), m);
+        size_t k = std::min(n, sizeof rx_buf - m);
+        memcpy(rx_buf + m, b, k);
+        process(c, m + k, 0);
+        b += k;
+        n -= k;
     }
-    return t;
 }
 
+// processes all complete PDUs in the first n bytes of rx_buf,
+// keeps the rest as partial PDU
+void Receiver::process(Connection &c, size_t n, uint64_t rx_ns)
+{
+    bool released = false;
+    // one clock read per read for all recorded PDUs
+    uint64_t record_ns = recorder ? (rx_ns ? rx_ns : stamp_now_ns()) : 0;
+    size_t k = cfg.frame(rx_buf, n, sizeof rx_buf,
+            [this, &c, &released, rx_ns, record_ns](const unsigned char *p, size_t l, unsigned tag) {
+                if (recorder)
+                    recorder->append(record_ns, c.session_id, tag, p, l);
+                ++metrics->receive_count;
+                ++*c.received;
+                if (cfg.correlation.size)
+                    correlate(c, p, l);
+                if (c.window)
+                    released |= complete(*c.window);
+                if (c.tx)
+                    record_rx(*c.tx, rx_ns);
+            });
+    c.partial.assign(rx_buf + k, rx_buf + n);
+    if (released && c.window->wake_fd != -1) {
+        // once per read, the sender resets it when it wakes up
+        uint64_t one = 1;
+        ++syscalls;
+        if (write(c.window->wake_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+            throw std::runtime_error("Receiver: couldn't wake up sender");
+    }
+}
+
+// returns true if it was the last connection
+bool Receiver::close_conn(int fd)
+{
+    auto r = conn_fds.erase(fd);
+    if (r)
+        ixxx::posix::close(fd);
+    else
+        std::cout << "WARNING: conn_fd " << fd << " alread closed!\n";
+    return conn_fds.empty();
+}
+
+// i.e. one sender closed its pipe write-end due to an error, thus
+// closing all registered connections to let other sender-threads
+// fail, as well
+void Receiver::close_all()
+{
+    std::cerr << "Receiver: pipe closed - closing all connections ...\n";
+    for (auto &x : conn_fds) {
+        std::cerr << "    closing conn " << x.first << '\n';
+        // we are ignoring errors here since we need to make sure
+        // to close _all_ connections to terminate the senders
+        // (and we are on an error path, anyways)
+        close(x.first);
+    }
+}
+
+void Receiver::add_conn(const Conn_Announcement &a)
+{
+    conn_fds[a.fd] = connections.size();
+    connections.emplace_back();
+    connections.back().session_id = a.session_id;
+    connections.back().stamps = a.stamps;
+    connections.back().window = a.window;
+    connections.back().received = a.received;
+    if (a.stamps && cfg.session_latencies)
+        connections.back().rtts = std::make_unique<Session_Histogram>();
+    if (a.writes) {
+        auto t = std::make_unique<Tx_State>();
+        t->writes = a.writes;
+        std::fill_n(t->kernel_tx_idx, Stamp_Table::SLOTS, uint64_t(-1));
+        connections.back().tx = std::move(t);
+    }
+    if (a.window && window_hists.empty())
+        window_hists.resize(cfg.window_phases);
+    if (a.leftover)
+        consume(connections.back(), a.leftover->data(), a.leftover->size());
+}
+
+// returns true if it closed the last connection
+bool Receiver::handle_conn_event(int fd, uint32_t events)
+{
+    if ((events & EPOLLERR) && !(events & EPOLLIN)) {
+        // the error queue has TX timestamps (e.g. ACKs) pending
+        Connection &c = connections[conn_fds.at(fd)];
+        if (c.tx)
+            read_errqueue(fd, c);
+    }
+    if (events & EPOLLIN) {
+        if (!receive(fd, connections[conn_fds.at(fd)])) {
+            std::cout << "Closing after EOF, conn_fd: " << fd <<  "\n";
+            return close_conn(fd);
+        }
+    }
+    if (events & (EPOLLHUP | EPOLLRDHUP)) {
+        // i.e. sender-thread shut its connection down, or server shut it down
+        std::cout << "Closing conn_fd: " << fd <<  "\n";
+        return close_conn(fd);
+    }
+    return false;
+}
 
 void *Receiver::main()
 {
+#ifdef TCPLOADGEN_URING
+    if (cfg.io_uring)
+        return uring_loop();
+#endif
     ixxx::util::FD efd ( ixxx::linux::epoll_create1(0) );
     struct epoll_event ev = { .events = EPOLLIN, .data = { .fd = pipe_out_fd } };
     ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, pipe_out_fd, &ev);
 
-    unsigned char buf[64*1024];
-
-
     struct epoll_event evs[16];
     for (;;) {
+        ++syscalls;
         int k = ixxx::linux::epoll_wait(efd, evs, sizeof evs / sizeof evs[0], -1);
         for (int i = 0; i < k; ++i) {
             int fd = evs[i].data.fd;
             if (fd == pipe_out_fd) {
-                int conn_fd = -1;
-                size_t n = ixxx::posix::read(fd, &conn_fd, sizeof conn_fd);
+                Conn_Announcement a;
+                ++syscalls;
+                size_t n = ixxx::posix::read(fd, &a, sizeof a);
                 if (!n) {
-                    // i.e. one sender closed its pipe write-end due to an error
-                    // thus closing all registered connections to let other sender-threads
-                    // fail, as well
-                    std::cerr << "Receiver: pipe closed - closing all connections ...\n";
-                    for (int x : conn_fds) {
-                        std::cerr << "    closing conn " << x << '\n';
-                        // we are ignoring errors here since we need to make sure
-                        // to close _all_ connections to terminate the senders
-                        // (and we are on an error path, anyways)
-                        close(x);
-                    }
+                    close_all();
                     return nullptr;
                 }
-                if (n != sizeof conn_fd) {
+                if (n != sizeof a) {
                     throw std::runtime_error("Receiver: short read on pipe");
                 }
-                struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data = { .fd = conn_fd } };
-                ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, conn_fd, &ev);
-                conn_fds.insert(conn_fd);
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data = { .fd = a.fd } };
+                ++syscalls;
+                ixxx::linux::epoll_ctl(efd, EPOLL_CTL_ADD, a.fd, &ev);
+                add_conn(a);
             } else {
-                if (evs[i].events & (EPOLLHUP | EPOLLRDHUP)) {
-                    // i.e. sender-thread shut its connection down, or server shut it down
-                    std::cout << "Closing conn_fd: " << fd <<  "\n";
-                    auto r = conn_fds.erase(fd);
-                    if (r)
-                        ixxx::posix::close(fd);
-                    else
-                        std::cout << "WARNING: conn_fd " << fd << " alread closed!\n";
-                    if (conn_fds.empty())
-                        return nullptr;
-                } else {
-                    try {
-                        cfg.receive_next(fd, buf, sizeof buf);
-                        ++receive_count;
-                    } catch (const std::underflow_error &e) {
-                        std::cout << "Closing after EOF, conn_fd: " << fd <<  "\n";
-                        auto r = conn_fds.erase(fd);
-                        if (r)
-                            ixxx::posix::close(fd);
-                        else
-                            std::cout << "WARNING: EOF conn_fd fd " << fd << " already closed!\n";
-                        if (conn_fds.empty())
-                            return nullptr;
-                    }
-                }
+                begin_phase();
+                if (handle_conn_event(fd, evs[i].events))
+                    return nullptr;
             }
         }
     }
@@ -168,7 +413,10 @@ static void *receiver_main(void *x)
 {
     Receiver *r = static_cast<Receiver*>(x);
     try {
-        return r->main();
+        void *v = r->main();
+        if (r->cpu0_ns)
+            r->cpu_ns = thread_cpu_ns() - r->cpu0_ns;
+        return v;
     } catch (std::exception &e) {
         close(r->pipe_out_fd);
         std::cerr << "Receiver failed: " << e.what() << '\n';
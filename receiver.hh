@@ -5,7 +5,15 @@
 #ifndef RECEIVER_HH
 #define RECEIVER_HH
 
-#include <unordered_set>
+#include "correlation.hh"
+#include "histogram.hh"
+#include "metrics.hh"
+#include "recorder.hh"
+
+#include <memory>
+#include <unordered_map>
+#include <stdexcept>
+#include <vector>
 #include <stdint.h>
 #include <pthread.h>
 
@@ -26,7 +34,94 @@ struct Receiver_Config {
     Field error_msg_len;
     unsigned error_msg_off {0};
 
-    unsigned receive_next(int fd, unsigned char *buf, size_t buf_size) const;
+    // optional, i.e. size == 0 disables request/response correlation
+    Field correlation;
+    // a round-trip histogram per session (about 2.4 KiB each),
+    // otherwise only the merged one is recorded
+    bool session_latencies {true};
+
+    // the senders process the responses of their sessions
+    // themselves, without separate receiver threads
+    bool inline_receive {false};
+
+    // SO_TIMESTAMPING with software TX, TX-ACK and RX stamps
+    // on the session sockets
+    bool timestamping {false};
+
+    // number of closed-loop window phases, 0 in open-loop mode
+    unsigned window_phases {0};
+
+    // io_uring backend (io.backend), i.e. multishot recv with a
+    // provided buffer ring of `buffers` (a power of 2) buffers
+    bool io_uring {false};
+    unsigned ring_entries {256};
+    unsigned buffers {64};
+    unsigned buffer_size {16 * 1024};
+
+    // returns the tag, throws on an error PDU
+    unsigned check_pdu(const unsigned char *b, size_t l) const;
+
+    // calls f(pdu, pdu_len, tag) for each complete PDU in b and
+    // returns the number of consumed bytes, i.e. the remaining
+    // bytes are the start of a partial PDU
+    template <typename F>
+    size_t frame(const unsigned char *b, size_t n, size_t max_pdu, F f) const
+    {
+        size_t hdr = len.off + len.size;
+        size_t i = 0;
+        while (n - i >= hdr) {
+            const unsigned char *p = b + i;
+            size_t l = len.read_uint(p, hdr);
+            if (l <= hdr)
+                throw std::runtime_error("message too short");
+            if (l > max_pdu)
+                throw std::runtime_error("message too long");
+            if (l > n - i)
+                break;
+            f(p, l, check_pdu(p, l));
+            i += l;
+        }
+        return i;
+    }
+};
+
+// kernel timestamping state of a connection, i.e. the TX stamps are
+// matched by write (in order) and the responses by request (in order,
+// thus, this assumes one response per request and one request per write)
+struct Tx_State {
+    // user-space write start times, keyed by write index << 32 | byte
+    // offset of the last byte of the write
+    const Stamp_Table *writes {nullptr};
+    // index of the next write whose SND/ACK stamp is expected
+    uint64_t snd_next {0};
+    uint64_t ack_next {0};
+    uint64_t responses {0};
+
+    // kernel SND stamps, by write index
+    uint64_t kernel_tx[Stamp_Table::SLOTS];
+    uint64_t kernel_tx_idx[Stamp_Table::SLOTS];
+
+    // returns true if the stamp with id belongs to the write next
+    // and advances next, returns the user-space write time in ts
+    bool match(uint64_t &next, uint32_t id, uint64_t &ts);
+};
+
+// round-trip latencies of one session's connection
+struct Connection {
+    unsigned session_id {0};
+    const Stamp_Table *stamps {nullptr};
+    // only set in closed-loop mode
+    Credit_Window *window {nullptr};
+    // responses of the session, in the metrics segment
+    Counter<uint64_t> *received {nullptr};
+    // only allocated with kernel timestamping
+    std::unique_ptr<Tx_State> tx;
+
+    // start of a PDU that didn't fit into the last read
+    std::vector<unsigned char> partial;
+
+    // only allocated in correlation mode, cf. Receiver_Config::session_latencies
+    std::unique_ptr<Session_Histogram> rtts;
 };
 
 struct Receiver {
@@ -41,14 +136,61 @@ struct Receiver {
     unsigned core {0};
 
     int pipe_out_fd {0};
-    std::unordered_set<int> conn_fds;
-
-    unsigned receive_count {0};
+    // fd -> index into connections
+    std::unordered_map<int, size_t> conn_fds;
+    std::vector<Connection> connections;
+
+    // receive counts and round-trip times of all connections,
+    // i.e. a record in the metrics segment
+    Receiver_Metrics *metrics {nullptr};
+    // closed-loop round-trip times, indexed by window phase
+    std::vector<Histogram> window_hists;
+
+    // kernel timestamping: start of the write -> kernel TX (software),
+    // kernel TX -> ACK and kernel TX -> kernel RX of the response
+    Histogram tx_kernel_hist;
+    Histogram tx_ack_hist;
+    Histogram wire_rtt_hist;
+
+    // for comparing the I/O backends, measured over the main flow phase
+    // like Sender::cpu_ns, from the first response on
+    uint64_t syscalls {0};
+    uint64_t cpu_ns {0};
+    uint64_t cpu0_ns {0};
+
+    void begin_phase()
+    {
+        if (cpu0_ns)
+            return;
+        cpu0_ns = thread_cpu_ns();
+        // the wait that returned the first response
+        syscalls = 1;
+    }
+
+    // only allocated in record mode, cf. record.file
+    std::unique_ptr<Recorder> recorder;
 
     void *main();
+    // cf. uring.cc
+    void *uring_loop();
 
     void spawn(bool affinity);
 
+    void add_conn(const Conn_Announcement &a);
+    bool handle_conn_event(int fd, uint32_t events);
+
+    bool receive(int fd, Connection &c);
+    void process(Connection &c, size_t n, uint64_t rx_ns);
+    void consume(Connection &c, const unsigned char *b, size_t n);
+    bool close_conn(int fd);
+    void close_all();
+    void correlate(Connection &c, const unsigned char *buf, size_t n);
+    bool complete(Credit_Window &w);
+    void read_errqueue(int fd, Connection &c);
+    void record_rx(Tx_State &t, uint64_t rx_ns);
+
+    unsigned char rx_buf[64*1024];
+
 };
 
 
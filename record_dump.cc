@@ -0,0 +1,181 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Companion tool for the tcploadgen record files (cf. record.file):
+// decodes the PDUs of one or more files (e.g. of all receiver threads)
+// and prints per-tag statistics, optionally also each record.
+//
+// Usage: tcploadgen_dump [-r] [-s] FILENAME...
+
+#include "recorder.hh"
+#include "histogram.hh"
+
+#include <ixxx/posix.hh>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>     // getopt
+
+
+namespace {
+
+struct Tag_Stats {
+    uint64_t count {0};
+    uint64_t bytes {0};
+    uint64_t min_len {uint64_t(-1)};
+    uint64_t max_len {0};
+    uint64_t first_ns {uint64_t(-1)};
+    uint64_t last_ns {0};
+    // between consecutive PDUs of this tag in the same session
+    std::unique_ptr<Histogram> gaps {std::make_unique<Histogram>()};
+};
+
+struct Dump {
+    bool print_records {false};
+    bool per_session {false};
+
+    std::map<unsigned, Tag_Stats> tags;
+    // (session, tag) -> last receive time
+    std::map<std::pair<unsigned, unsigned>, uint64_t> last;
+    std::map<unsigned, uint64_t> sessions;
+    uint64_t dropped {0};
+
+    void add(const Record &r, const unsigned char *pdu);
+    void read(const char *filename);
+    void print(std::ostream &o) const;
+};
+
+}
+
+void Dump::add(const Record &r, const unsigned char *pdu)
+{
+    Tag_Stats &t = tags[r.tag];
+    ++t.count;
+    t.bytes += r.len;
+    t.min_len = std::min<uint64_t>(t.min_len, r.len);
+    t.max_len = std::max<uint64_t>(t.max_len, r.len);
+    t.first_ns = std::min(t.first_ns, r.rx_ns);
+    t.last_ns = std::max(t.last_ns, r.rx_ns);
+    auto i = last.emplace(std::make_pair(r.session_id, r.tag), r.rx_ns);
+    if (!i.second) {
+        t.gaps->record(r.rx_ns > i.first->second ? r.rx_ns - i.first->second : 0);
+        i.first->second = r.rx_ns;
+    }
+    ++sessions[r.session_id];
+
+    if (print_records) {
+        std::cout << r.rx_ns << ' ' << r.session_id << ' ' << r.tag << ' ' << r.len << ' ';
+        std::ostringstream o;
+        o << std::hex << std::setfill('0');
+        for (uint32_t j = 0; j < r.len; ++j)
+            o << std::setw(2) << unsigned(pdu[j]);
+        std::cout << o.str() << '\n';
+    }
+}
+
+void Dump::read(const char *filename)
+{
+    int fd = ixxx::posix::open(filename, O_RDONLY);
+    struct stat st;
+    ixxx::posix::fstat(fd, &st);
+    void *p = ixxx::posix::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ixxx::posix::close(fd);
+    const Record_Header &h = *static_cast<const Record_Header*>(p);
+    h.check(st.st_size);
+
+    // the file of a running generator is decoded up to its last complete record
+    uint64_t end = h.end.load(std::memory_order_acquire);
+    const unsigned char *b = static_cast<const unsigned char*>(p);
+    uint64_t i = Record_Header::align(sizeof h);
+    while (i < end) {
+        Record r;
+        if (end - i < sizeof r)
+            throw std::runtime_error("truncated record");
+        memcpy(&r, b + i, sizeof r);
+        uint64_t n = Record_Header::align(sizeof r + r.len);
+        if (n > end - i)
+            throw std::runtime_error("truncated record");
+        add(r, b + i + sizeof r);
+        i += n;
+    }
+    dropped += h.dropped.load(std::memory_order_relaxed);
+    munmap(p, st.st_size);
+}
+
+void Dump::print(std::ostream &o) const
+{
+    for (auto &x : tags) {
+        const Tag_Stats &t = x.second;
+        o << "Tag " << x.first << ": n=" << t.count << " bytes=" << t.bytes
+            << " len min=" << t.min_len << " avg=" << double(t.bytes) / t.count
+            << " max=" << t.max_len;
+        if (t.last_ns > t.first_ns)
+            o << " rate=" << (t.count - 1) / ((t.last_ns - t.first_ns) / 1e9) << "/s";
+        if (t.gaps->count) {
+            o << " gap (ns)";
+            for (double q : { 50.0, 90.0, 99.0, 99.9 })
+                o << " p" << q << '=' << t.gaps->percentile(q);
+        }
+        o << '\n';
+    }
+    if (per_session)
+        for (auto &x : sessions)
+            o << "Session " << x.first << ": n=" << x.second << '\n';
+    o << "Dropped PDUs (record file full): " << dropped << '\n';
+}
+
+static void help(std::ostream &o, const char *argv0)
+{
+    o << argv0 << " - decode tcploadgen record files\n"
+        << "Usage: " << argv0 << " [-r] [-s] FILENAME...\n"
+        << "\n"
+        << "Options:\n"
+        << "  -r      also print each record (rx_ns session tag len hex-pdu)\n"
+        << "  -s      also print the per-session counts\n"
+        << "  -h      display this help\n";
+}
+
+int main(int argc, char **argv)
+{
+    try {
+        Dump d;
+        int c;
+        while ((c = getopt(argc, argv, "hrs")) != -1) {
+            switch (c) {
+                case 'h':
+                    help(std::cout, argv[0]);
+                    return 0;
+                case 'r':
+                    d.print_records = true;
+                    break;
+                case 's':
+                    d.per_session = true;
+                    break;
+                default:
+                    help(std::cerr, argv[0]);
+                    return 2;
+            }
+        }
+        if (optind == argc) {
+            help(std::cerr, argv[0]);
+            return 2;
+        }
+        for (int i = optind; i < argc; ++i)
+            d.read(argv[i]);
+        d.print(std::cout);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "recorder.hh"
+#include "correlation.hh" // stamp_now_ns
+
+#include <ixxx/posix.hh>
+
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>     // getpid
+
+
+void Record_Header::check(size_t mapped_size) const
+{
+    if (mapped_size < sizeof *this || memcmp(magic, RECORD_MAGIC, sizeof magic))
+        throw std::runtime_error("not a tcploadgen record file");
+    if (version != RECORD_VERSION || header_size != sizeof *this
+            || record_size != sizeof(Record)) {
+        std::ostringstream o;
+        o << "incompatible record file version: " << version
+            << " (expected: " << RECORD_VERSION << ')';
+        throw std::runtime_error(o.str());
+    }
+    if (end.load(std::memory_order_acquire) > mapped_size)
+        throw std::runtime_error("truncated record file");
+}
+
+void Recorder::create(const std::string &filename, uint64_t size, unsigned core)
+{
+    if (size < Record_Header::align(sizeof(Record_Header)) + 4096) {
+        std::ostringstream o;
+        o << "record.size is too small: " << size;
+        throw std::runtime_error(o.str());
+    }
+    fd = ixxx::posix::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    void *p = nullptr;
+    try {
+        // the blocks are allocated up front, not while receiving
+        int r = posix_fallocate(fd, 0, size);
+        if (r) {
+            std::ostringstream o;
+            o << "couldn't allocate " << size << " bytes for " << filename << " (" << r << ')';
+            throw std::runtime_error(o.str());
+        }
+        // also pre-faults the pages
+        p = ixxx::posix::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+    } catch (...) {
+        close(fd);
+        fd = -1;
+        throw;
+    }
+    header = new (p) Record_Header();
+    header->version = RECORD_VERSION;
+    header->header_size = sizeof(Record_Header);
+    header->record_size = sizeof(Record);
+    header->core = core;
+    header->size = size;
+    header->start_ns = stamp_now_ns();
+    header->pid = getpid();
+    end = Record_Header::align(sizeof(Record_Header));
+    header->end.store(end, std::memory_order_relaxed);
+    base = static_cast<unsigned char*>(p);
+
+    // readers don't see a valid file before it's initialized
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, RECORD_MAGIC, sizeof RECORD_MAGIC);
+}
+
+Recorder::~Recorder()
+{
+    if (!header)
+        return;
+    uint64_t size = header->size;
+    munmap(header, size);
+    // the unused pre-allocated space isn't kept
+    if (ftruncate(fd, end) == -1)
+        std::cerr << "WARNING: couldn't truncate record file (" << errno << ")\n";
+    close(fd);
+}
@@ -0,0 +1,97 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef RECORDER_HH
+#define RECORDER_HH
+
+#include <atomic>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Layout of a record file (cf. record.file), i.e. each receiver thread
+// appends the PDUs it frames to its own pre-allocated, memory-mapped
+// file (cf. record_dump.cc):
+//
+//     Record_Header
+//     Record, PDU bytes, padding to 8 bytes
+//     ...
+//
+// There is a single writer per file. It publishes the end of the last
+// complete record with a release store, thus, a reader may also
+// decode the file of a running generator.
+// Any layout change has to bump RECORD_VERSION.
+
+static constexpr char RECORD_MAGIC[8] = { 'T', 'L', 'G', 'R', 'E', 'C', 'R', 'D' };
+static constexpr uint32_t RECORD_VERSION = 1;
+
+struct Record {
+    // CLOCK_REALTIME, i.e. the kernel RX stamp with sender.timestamping,
+    // otherwise the time the read returned
+    uint64_t rx_ns;
+    uint32_t session_id;
+    uint32_t tag;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct Record_Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    // of the receiver thread
+    uint32_t core;
+
+    // of the pre-allocated file
+    uint64_t size;
+    // CLOCK_REALTIME
+    uint64_t start_ns;
+    uint64_t pid;
+
+    // offset behind the last complete record
+    std::atomic<uint64_t> end;
+    // PDUs that didn't fit anymore
+    std::atomic<uint64_t> dropped;
+
+    static constexpr uint64_t align(uint64_t x) { return (x + 7) / 8 * 8; }
+
+    // throws if the file was written by an incompatible version
+    void check(size_t mapped_size) const;
+};
+
+// owns the mapping of one record file
+struct Recorder {
+    Recorder() = default;
+    Recorder(const Recorder &) = delete;
+    Recorder &operator=(const Recorder &) = delete;
+    // truncates the file to the recorded size
+    ~Recorder();
+
+    Record_Header *header {nullptr};
+    unsigned char *base {nullptr};
+    int fd {-1};
+    uint64_t end {0};
+    uint64_t dropped {0};
+
+    void create(const std::string &filename, uint64_t size, unsigned core);
+
+    // stores the only copy of the PDU, directly from the receive buffer
+    void append(uint64_t rx_ns, unsigned session_id, unsigned tag,
+            const unsigned char *p, size_t l)
+    {
+        uint64_t n = Record_Header::align(sizeof(Record) + l);
+        if (n > header->size - end) {
+            header->dropped.store(++dropped, std::memory_order_relaxed);
+            return;
+        }
+        Record r = { rx_ns, uint32_t(session_id), uint32_t(tag), uint32_t(l), 0 };
+        memcpy(base + end, &r, sizeof r);
+        memcpy(base + end + sizeof r, p, l);
+        end += n;
+        header->end.store(end, std::memory_order_release);
+    }
+};
+
+#endif
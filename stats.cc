@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "stats.hh"
+
+#include "client.hh"
+
+#include <ixxx/posix.hh>
+#include <ixxx/linux.hh>
+#include <ixxx/pthread.hh>
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <errno.h>
+#include <poll.h>           // ppoll
+#include <sys/eventfd.h>
+#include <unistd.h>         // write
+
+
+void Stats_Reporter::report(uint64_t now)
+{
+    Totals cur;
+    auto tmp = std::make_unique<Histogram>();
+    auto send_error = std::make_unique<Histogram>();
+    auto rtt = std::make_unique<Histogram>();
+
+    auto add_receiver = [&cur, &tmp, &rtt](const Receiver &r) {
+        cur.received += r.metrics->receive_count;
+        cur.unmatched += r.metrics->unmatched_count;
+        tmp->snapshot(r.metrics->rtt_hist);
+        rtt->merge(*tmp);
+    };
+    for (auto &sender : senders) {
+        cur.sent += sender.metrics->send_count;
+        cur.late += sender.metrics->timer_was_late;
+        cur.dropped += sender.metrics->dropped_count;
+        tmp->snapshot(sender.metrics->send_error_hist);
+        send_error->merge(*tmp);
+        if (sender.rx)
+            add_receiver(*sender.rx);
+    }
+    for (auto &receiver : receivers)
+        add_receiver(receiver);
+
+    auto d_send_error = std::make_unique<Histogram>(*send_error);
+    auto d_rtt = std::make_unique<Histogram>(*rtt);
+    if (last_send_error) {
+        d_send_error->subtract(*last_send_error);
+        d_rtt->subtract(*last_rtt);
+    }
+    double s = (now - last_ns) / 1e9;
+
+    // only the rates are printed as floating point numbers, the
+    // timestamp and counters as integers, without loss of precision
+    struct Column {
+        const char *name;
+        uint64_t u;
+        double d;
+        bool real;
+    };
+    auto u = [](const char *name, uint64_t v) { return Column { name, v, 0, false }; };
+    auto d = [](const char *name, double v) { return Column { name, 0, v, true }; };
+    Column cols[] = {
+        u("ts_ns",              now),
+        u("interval",           interval),
+        u("sent",               cur.sent - last.sent),
+        u("received",           cur.received - last.received),
+        u("late_timers",        cur.late - last.late),
+        u("dropped",            cur.dropped - last.dropped),
+        u("unmatched",          cur.unmatched - last.unmatched),
+        d("send_rate",          (cur.sent - last.sent) / s),
+        d("receive_rate",       (cur.received - last.received) / s),
+        u("send_error_p50_ns",  d_send_error->percentile(50)),
+        u("send_error_p99_ns",  d_send_error->percentile(99)),
+        u("send_error_p999_ns", d_send_error->percentile(99.9)),
+        u("rtt_count",          d_rtt->count),
+        u("rtt_p50_ns",         d_rtt->percentile(50)),
+        u("rtt_p99_ns",         d_rtt->percentile(99)),
+        u("rtt_p999_ns",        d_rtt->percentile(99.9))
+    };
+    std::ostream &o = *out;
+    o.precision(15);
+    auto value = [&o](const Column &c) {
+        if (c.real)
+            o << c.d;
+        else
+            o << c.u;
+    };
+    if (cfg.csv) {
+        if (!interval) {
+            for (auto &c : cols)
+                o << (&c == cols ? "" : ",") << c.name;
+            o << '\n';
+        }
+        for (auto &c : cols) {
+            o << (&c == cols ? "" : ",");
+            value(c);
+        }
+        o << '\n';
+    } else {
+        o << '{';
+        for (auto &c : cols) {
+            o << (&c == cols ? "" : ", ") << '"' << c.name << "\": ";
+            value(c);
+        }
+        o << "}\n";
+    }
+    o.flush();
+
+    last = cur;
+    last_send_error = std::move(send_error);
+    last_rtt = std::move(rtt);
+    last_ns = now;
+    ++interval;
+}
+
+void *Stats_Reporter::main()
+{
+    uint64_t next = last_ns + cfg.interval_ns;
+    for (;;) {
+        uint64_t now = stamp_now_ns();
+        if (now >= next) {
+            report(now);
+            next += cfg.interval_ns;
+            continue;
+        }
+        struct pollfd p = { .fd = stop_fd, .events = POLLIN };
+        struct timespec ts = { .tv_sec = time_t((next - now) / 1000000000ul),
+            .tv_nsec = long((next - now) % 1000000000ul) };
+        int r = ppoll(&p, 1, &ts, nullptr);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            std::ostringstream o;
+            o << "Stats: ppoll failed (" << errno << ')';
+            throw std::runtime_error(o.str());
+        }
+        if (r)
+            return nullptr;
+    }
+    return nullptr;
+}
+
+static void *stats_main(void *x)
+{
+    Stats_Reporter *r = static_cast<Stats_Reporter*>(x);
+    try {
+        return r->main();
+    } catch (std::exception &e) {
+        std::cerr << "Stats reporter failed: " << e.what() << '\n';
+        return (void*)-1;
+    }
+}
+
+void Stats_Reporter::spawn()
+{
+    if (cfg.filename.empty()) {
+        out = &std::cout;
+    } else {
+        file.open(cfg.filename);
+        if (!file)
+            throw std::runtime_error("Couldn't open stats file: " + cfg.filename);
+        out = &file;
+    }
+    stop_fd = ixxx::linux::eventfd(0, EFD_CLOEXEC);
+    last_ns = stamp_now_ns();
+    ixxx::posix::pthread_create(&thread_id, nullptr, stats_main,
+            static_cast<void*>(this));
+}
+
+void Stats_Reporter::stop()
+{
+    uint64_t one = 1;
+    ixxx::posix::write(stop_fd, &one, sizeof one);
+    void *v = nullptr;
+    ixxx::posix::pthread_join(thread_id, &v);
+    ixxx::posix::close(stop_fd);
+    report(stamp_now_ns());
+}
@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef STATS_HH
+#define STATS_HH
+
+#include "histogram.hh"
+
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+struct Sender;
+struct Receiver;
+
+struct Stats_Config {
+    // 0 disables live statistics
+    uint64_t interval_ns {0};
+    // otherwise JSON lines
+    bool csv {false};
+    // empty: stdout
+    std::string filename;
+};
+
+// Samples the counters and histograms of the sender and receiver
+// threads each interval and writes one record with the deltas, i.e.
+// it only reads and never locks the hot path.
+struct Stats_Reporter {
+
+    Stats_Reporter(const Stats_Config &cfg, const std::vector<Sender> &senders,
+            const std::vector<Receiver> &receivers)
+        : cfg(cfg), senders(senders), receivers(receivers) {}
+
+    const Stats_Config &cfg;
+    const std::vector<Sender> &senders;
+    const std::vector<Receiver> &receivers;
+
+    pthread_t thread_id {0};
+    // signals the end of the run
+    int stop_fd {-1};
+    std::ofstream file;
+    std::ostream *out {nullptr};
+
+    unsigned interval {0};
+    uint64_t last_ns {0};
+
+    struct Totals {
+        uint64_t sent {0};
+        uint64_t received {0};
+        uint64_t late {0};
+        uint64_t dropped {0};
+        uint64_t unmatched {0};
+    };
+    Totals last;
+    // the previous snapshots, for computing the interval deltas
+    std::unique_ptr<Histogram> last_send_error;
+    std::unique_ptr<Histogram> last_rtt;
+
+    void *main();
+    void report(uint64_t now);
+
+    void spawn();
+    // writes a last record and joins the thread
+    void stop();
+};
+
+#endif
@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef TIMER_HEAP_HH
+#define TIMER_HEAP_HH
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// 4-ary min-heap of (deadline, session index) pairs, i.e. the
+// in-process replacement for one kernel timer per session.
+//
+// A 4-ary heap is shallower than a binary one, i.e. a sift touches
+// fewer levels, and the 4 children of a node are adjacent in memory.
+struct Timer_Heap {
+    struct Entry {
+        uint64_t deadline;
+        uint32_t idx;
+    };
+    std::vector<Entry> v;
+
+    bool empty() const { return v.empty(); }
+    size_t size() const { return v.size(); }
+    const Entry &top() const { return v.front(); }
+
+    void reserve(size_t n) { v.reserve(n); }
+
+    void push(uint64_t deadline, uint32_t idx)
+    {
+        v.push_back(Entry{deadline, idx});
+        sift_up(v.size() - 1);
+    }
+    void pop()
+    {
+        v.front() = v.back();
+        v.pop_back();
+        if (!v.empty())
+            sift_down(0);
+    }
+    // reschedules the top entry
+    void replace_top(uint64_t deadline)
+    {
+        v.front().deadline = deadline;
+        sift_down(0);
+    }
+
+    void sift_up(size_t i)
+    {
+        Entry e = v[i];
+        while (i) {
+            size_t p = (i - 1) / 4;
+            if (v[p].deadline <= e.deadline)
+                break;
+            v[i] = v[p];
+            i = p;
+        }
+        v[i] = e;
+    }
+    void sift_down(size_t i)
+    {
+        Entry e = v[i];
+        size_t n = v.size();
+        for (;;) {
+            size_t c = 4 * i + 1;
+            if (c >= n)
+                break;
+            size_t m = c;
+            size_t end = c + 4 < n ? c + 4 : n;
+            for (size_t j = c + 1; j < end; ++j)
+                if (v[j].deadline < v[m].deadline)
+                    m = j;
+            if (e.deadline <= v[m].deadline)
+                break;
+            v[i] = v[m];
+            i = m;
+        }
+        v[i] = e;
+    }
+};
+
+#endif
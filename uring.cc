@@ -0,0 +1,345 @@
+// SPDX-FileCopyrightText: © 2021 Georg Sauthoff <mail@gms.tf>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Optional io_uring backend (io.backend = 'io_uring'), only compiled
+// when liburing is found (TCPLOADGEN_URING).
+//
+// The sender prepares the sends of all sessions that are due in one
+// wake-up and submits them together with the next timeout, i.e. there
+// is no timerfd and no syscall per message. The receiver uses a
+// multishot recv per connection with a provided buffer ring, i.e. no
+// syscall per read.
+
+#include "client.hh"
+
+#include <liburing.h>
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+
+namespace {
+
+enum : uint64_t {
+    TIMEOUT_TAG = uint64_t(-1),
+    POLL_TAG    = uint64_t(-2),
+    PIPE_TAG    = uint64_t(-3)
+};
+
+[[noreturn]] void throw_error(const char *msg, int fd, int e)
+{
+    std::ostringstream o;
+    o << msg << " on fd " << fd << " (" << e << ')';
+    throw std::runtime_error(o.str());
+}
+
+struct Ring {
+    struct io_uring ring;
+
+    Ring(unsigned entries)
+    {
+        int r = io_uring_queue_init(entries, &ring, 0);
+        if (r < 0)
+            throw_error("io_uring_queue_init failed", -1, -r);
+    }
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+    ~Ring() { io_uring_queue_exit(&ring); }
+
+    // submits the prepared ones if the submission queue is full
+    struct io_uring_sqe *sqe(uint64_t &syscalls)
+    {
+        struct io_uring_sqe *e = io_uring_get_sqe(&ring);
+        if (!e) {
+            ++syscalls;
+            int r = io_uring_submit(&ring);
+            if (r < 0)
+                throw_error("io_uring_submit failed", -1, -r);
+            e = io_uring_get_sqe(&ring);
+            if (!e)
+                throw std::runtime_error("io_uring submission queue is full");
+        }
+        return e;
+    }
+
+    // returns false on EINTR
+    bool submit_and_wait(uint64_t &syscalls)
+    {
+        ++syscalls;
+        int r = io_uring_submit_and_wait(&ring, 1);
+        if (r == -EINTR)
+            return false;
+        if (r < 0)
+            throw_error("io_uring_submit_and_wait failed", -1, -r);
+        return true;
+    }
+};
+
+}
+
+// owns the rendered patch regions and the iovecs of the in-flight sends,
+// they have to stay valid until their completion
+struct Uring_Sender {
+    Uring_Sender(unsigned entries) : ring(entries) {}
+
+    Ring ring;
+
+    struct Slot {
+        struct msghdr msg;
+        struct iovec iov[3];
+        size_t len {0};
+        size_t session {0};
+        // start of the send and its intended time
+        uint64_t t0 {0};
+        uint64_t sched_ns {0};
+    };
+    std::vector<Slot> slots;
+    std::vector<unsigned> free_slots;
+    std::vector<unsigned char> patches;
+    size_t patch_len {0};
+    unsigned inflight {0};
+    // in-flight sends of each session, i.e. at most one such that the
+    // kernel can't reorder them
+    std::vector<unsigned char> session_inflight;
+
+    // absolute CLOCK_REALTIME deadline of the armed timeout
+    struct __kernel_timespec timeout {};
+    bool timeout_armed {false};
+    bool due {false};
+};
+
+void Sender::uring_reap()
+{
+    Uring_Sender &u = *uring;
+    struct io_uring_cqe *cqes[64];
+    for (;;) {
+        unsigned k = io_uring_peek_batch_cqe(&u.ring.ring, cqes, sizeof cqes / sizeof cqes[0]);
+        for (unsigned i = 0; i < k; ++i) {
+            const struct io_uring_cqe &cqe = *cqes[i];
+            uint64_t tag = io_uring_cqe_get_data64(&cqe);
+            if (tag == TIMEOUT_TAG) {
+                if (cqe.res != -ETIME)
+                    throw_error("io_uring timeout failed", -1, -cqe.res);
+                u.timeout_armed = false;
+                u.due = true;
+            } else if (tag == POLL_TAG) {
+                // a receiver closed its pipe, cf. dispatch()
+                throw std::runtime_error("receiver terminated early");
+            } else {
+                Uring_Sender::Slot &s = u.slots[tag];
+                int fd = sessions[s.session].fd;
+                if (cqe.res < 0)
+                    throw_error("sendmsg failed", fd, -cqe.res);
+                if (size_t(cqe.res) < s.len) {
+                    // interrupted, the remainder is written synchronously
+                    struct iovec *iov = s.iov;
+                    int n = s.msg.msg_iovlen;
+                    size_t l = cqe.res;
+                    for (; n && l >= iov->iov_len; ++iov, --n)
+                        l -= iov->iov_len;
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + l;
+                    iov->iov_len -= l;
+                    ++syscalls;
+                    writev_all(fd, iov, n);
+                }
+                // the completion as seen by the sender, comparable to
+                // the return of a write call
+                uint64_t t1 = stamp_now_ns();
+                metrics->write_hist.record(t1 - s.t0);
+                completion_hist.record(t1 > s.sched_ns ? t1 - s.sched_ns : 0);
+                u.free_slots.push_back(unsigned(tag));
+                --u.inflight;
+                --u.session_inflight[s.session];
+            }
+        }
+        io_uring_cq_advance(&u.ring.ring, k);
+        if (k < sizeof cqes / sizeof cqes[0])
+            break;
+    }
+}
+
+// submits the prepared sends and waits for at least one completion
+void Sender::uring_wait()
+{
+    if (uring->ring.submit_and_wait(syscalls))
+        uring_reap();
+}
+
+void Sender::uring_flush()
+{
+    while (uring->inflight)
+        uring_wait();
+}
+
+// A session with a send in flight or a full ring is backpressure, like
+// a full outbound queue with the epoll backend, i.e. the sender doesn't
+// wait for the completions of a slow session.
+bool Sender::uring_ready(const Session &session) const
+{
+    return !uring->session_inflight[&session - sessions.data()] && !uring->free_slots.empty();
+}
+
+// prepares the send, it's submitted with the next timeout
+void Sender::uring_send(Session &session, const Packet &packet, const unsigned char *patch,
+        uint64_t t0, uint64_t sched_ns)
+{
+    Uring_Sender &u = *uring;
+    size_t idx = &session - sessions.data();
+    unsigned i = u.free_slots.back();
+    u.free_slots.pop_back();
+    Uring_Sender::Slot &s = u.slots[i];
+    unsigned char *p = u.patches.data() + i * u.patch_len;
+    if (packet.patch_len)
+        memcpy(p, patch, packet.patch_len);
+    s.msg = {};
+    s.msg.msg_iov = s.iov;
+    s.msg.msg_iovlen = packet_iov(packet, p, s.iov);
+    s.len = packet.payload.size();
+    s.session = idx;
+    s.t0 = t0;
+    s.sched_ns = sched_ns;
+
+    struct io_uring_sqe *e = u.ring.sqe(syscalls);
+    io_uring_prep_sendmsg(e, session.fd, &s.msg, 0);
+    io_uring_sqe_set_data64(e, i);
+    ++u.inflight;
+    ++u.session_inflight[idx];
+}
+
+// the timer driven main loop, cf. Sender::run()
+void *Sender::uring_loop(int efd)
+{
+    Uring_Sender u(cfg.ring_entries);
+    u.slots.resize(cfg.ring_entries);
+    for (unsigned i = cfg.ring_entries; i > 0; --i)
+        u.free_slots.push_back(i - 1);
+    u.patch_len = patch_buf.size();
+    u.patches.resize(cfg.ring_entries * u.patch_len);
+    u.session_inflight.resize(sessions.size());
+
+    struct Reset {
+        Sender &s;
+        ~Reset() { s.uring = nullptr; }
+    } reset { *this };
+    uring = &u;
+
+    // the epoll set signals a closed receiver pipe
+    struct io_uring_sqe *e = u.ring.sqe(syscalls);
+    io_uring_prep_poll_add(e, efd, POLLIN);
+    io_uring_sqe_set_data64(e, POLL_TAG);
+
+    for (;;) {
+        if (!u.timeout_armed) {
+            uint64_t deadline = timers.top().deadline;
+            u.timeout.tv_sec = deadline / 1000000000ul;
+            u.timeout.tv_nsec = deadline % 1000000000ul;
+            e = u.ring.sqe(syscalls);
+            io_uring_prep_timeout(e, &u.timeout, 0, IORING_TIMEOUT_ABS | IORING_TIMEOUT_REALTIME);
+            io_uring_sqe_set_data64(e, TIMEOUT_TAG);
+            u.timeout_armed = true;
+        }
+        // also submits the sends of the last wake-up
+        uring_wait();
+        if (u.due) {
+            u.due = false;
+            if (!fire_due(stamp_now_ns()))
+                return 0;
+        }
+        refill_rings();
+    }
+    return 0;
+}
+
+
+void *Receiver::uring_loop()
+{
+    Ring r(cfg.ring_entries);
+
+    std::vector<unsigned char> bufs(size_t(cfg.buffers) * cfg.buffer_size);
+    const int bgid = 0;
+    struct Buf_Ring {
+        struct io_uring *ring;
+        unsigned n;
+        struct io_uring_buf_ring *br {nullptr};
+        ~Buf_Ring()
+        {
+            if (br)
+                io_uring_free_buf_ring(ring, br, n, bgid);
+        }
+    } b { &r.ring, cfg.buffers };
+    int ret = 0;
+    b.br = io_uring_setup_buf_ring(&r.ring, cfg.buffers, bgid, 0, &ret);
+    if (!b.br)
+        throw_error("Receiver: io_uring_setup_buf_ring failed", -1, -ret);
+    int mask = io_uring_buf_ring_mask(cfg.buffers);
+    for (unsigned i = 0; i < cfg.buffers; ++i)
+        io_uring_buf_ring_add(b.br, bufs.data() + size_t(i) * cfg.buffer_size,
+                cfg.buffer_size, i, mask, i);
+    io_uring_buf_ring_advance(b.br, cfg.buffers);
+
+    Conn_Announcement a;
+    auto read_pipe = [this, &r, &a]() {
+        struct io_uring_sqe *e = r.sqe(syscalls);
+        io_uring_prep_read(e, pipe_out_fd, &a, sizeof a, 0);
+        io_uring_sqe_set_data64(e, PIPE_TAG);
+    };
+    auto recv_multishot = [this, &r, bgid](int fd) {
+        struct io_uring_sqe *e = r.sqe(syscalls);
+        io_uring_prep_recv_multishot(e, fd, nullptr, 0, 0);
+        e->flags |= IOSQE_BUFFER_SELECT;
+        e->buf_group = bgid;
+        io_uring_sqe_set_data64(e, uint64_t(fd));
+    };
+    read_pipe();
+
+    struct io_uring_cqe *cqes[64];
+    for (;;) {
+        if (!r.submit_and_wait(syscalls))
+            continue;
+        unsigned k = io_uring_peek_batch_cqe(&r.ring, cqes, sizeof cqes / sizeof cqes[0]);
+        for (unsigned i = 0; i < k; ++i) {
+            const struct io_uring_cqe &cqe = *cqes[i];
+            uint64_t tag = io_uring_cqe_get_data64(&cqe);
+            if (tag == PIPE_TAG) {
+                if (!cqe.res) {
+                    close_all();
+                    return nullptr;
+                }
+                if (cqe.res != sizeof a)
+                    throw std::runtime_error("Receiver: short read on pipe");
+                add_conn(a);
+                recv_multishot(a.fd);
+                read_pipe();
+                continue;
+            }
+            int fd = int(tag);
+            if (cqe.res > 0) {
+                begin_phase();
+                unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                unsigned char *p = bufs.data() + size_t(bid) * cfg.buffer_size;
+                consume(connections[conn_fds.at(fd)], p, cqe.res);
+                io_uring_buf_ring_add(b.br, p, cfg.buffer_size, bid, mask, 0);
+                io_uring_buf_ring_advance(b.br, 1);
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                    recv_multishot(fd);
+            } else if (cqe.res == -ENOBUFS) {
+                // all buffers were in use, which terminates the multishot recv
+                recv_multishot(fd);
+            } else if (!cqe.res) {
+                // the sender-thread shut its connection down, or the server did
+                std::cout << "Closing after EOF, conn_fd: " << fd <<  "\n";
+                if (close_conn(fd))
+                    return nullptr;
+            } else {
+                throw_error("Receiver: recv failed", fd, -cqe.res);
+            }
+        }
+        io_uring_cq_advance(&r.ring, k);
+    }
+    return nullptr;
+}